@@ -6,20 +6,24 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <gbm.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
 #include <math.h>
 #include <pixman.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <wayland-server.h>
@@ -87,6 +91,7 @@ struct xwl_mmap {
   xwl_begin_end_access_func_t begin_access;
   xwl_begin_end_access_func_t end_access;
   struct wl_resource *buffer_resource;
+  struct xwl_mmap *parent;
 };
 
 struct xwl_output_buffer;
@@ -105,6 +110,31 @@ struct xwl_host_surface {
   struct xwl_output_buffer *current_buffer;
   struct wl_list released_buffers;
   struct wl_list busy_buffers;
+  size_t buffer_bytes;
+  uint64_t last_commit_time;
+  struct wl_list link;
+  struct xwl_host_output *output;
+  struct wl_array entered_outputs;
+};
+
+struct xwl_virtwl_pool {
+  struct xwl *xwl;
+  struct wl_list link;
+  struct wl_shm_pool *proxy;
+  int fd;
+  struct xwl_mmap *mmap;
+  size_t size;
+  size_t used;
+  uint64_t empty_time;
+  struct wl_list blocks;
+};
+
+struct xwl_virtwl_block {
+  struct wl_list link;
+  struct xwl_virtwl_pool *pool;
+  size_t offset;
+  size_t size;
+  int busy;
 };
 
 struct xwl_output_buffer {
@@ -114,6 +144,7 @@ struct xwl_output_buffer {
   uint32_t format;
   struct wl_buffer *internal;
   struct xwl_mmap *mmap;
+  struct xwl_virtwl_block *block;
   struct pixman_region32 damage;
   struct xwl_host_surface *surface;
 };
@@ -181,6 +212,7 @@ struct xwl_host_output {
   struct wl_resource *resource;
   struct wl_output *proxy;
   struct zaura_output *aura_output;
+  struct wl_list link;
   int x;
   int y;
   int physical_width;
@@ -195,6 +227,7 @@ struct xwl_host_output {
   int refresh;
   int scale_factor;
   int current_scale;
+  int last_current_scale;
   int max_scale;
 };
 
@@ -212,16 +245,38 @@ struct xwl_seat {
   uint32_t version;
   struct xwl_global *host_global;
   uint32_t last_serial;
+  struct wl_list host_pointers;
   struct wl_list link;
 };
 
 struct xwl_host_pointer {
   struct xwl_seat *seat;
+  struct wl_list link;
   struct wl_resource *resource;
   struct wl_pointer *proxy;
   struct wl_resource *focus_resource;
   struct wl_listener focus_resource_listener;
   uint32_t focus_serial;
+  struct wl_event_source *coalesce_event_source;
+  int has_pending_motion;
+  uint32_t pending_motion_time;
+  wl_fixed_t pending_x;
+  wl_fixed_t pending_y;
+  int has_pending_axis[2];
+  uint32_t pending_axis_time[2];
+  wl_fixed_t pending_axis_value[2];
+  int has_pending_frame;
+};
+
+struct xwl_keymap {
+  struct wl_list link;
+  uint64_t hash;
+  size_t size;
+  char *text;
+  struct xkb_keymap *keymap;
+  xkb_mod_mask_t control_mask;
+  xkb_mod_mask_t alt_mask;
+  xkb_mod_mask_t shift_mask;
 };
 
 struct xwl_host_keyboard {
@@ -288,7 +343,7 @@ struct xwl_host_data_offer {
 struct xwl_data_offer {
   struct xwl *xwl;
   struct wl_data_offer *internal;
-  int utf8_text;
+  uint32_t mime_types;
 };
 
 struct xwl_data_source {
@@ -420,6 +475,7 @@ struct xwl_window {
   int width;
   int height;
   int border_width;
+  double scale;
   int depth;
   int managed;
   int realized;
@@ -431,14 +487,19 @@ struct xwl_window {
   char *name;
   char *clazz;
   char *startup_id;
+  int has_net_wm_name;
   uint32_t size_flags;
+  uint32_t dirty_properties;
   struct xwl_config next_config;
   struct xwl_config pending_config;
+  struct wl_callback *frame_callback;
+  struct wl_event_source *frame_timeout_event_source;
   struct zxdg_surface_v6 *xdg_surface;
   struct zxdg_toplevel_v6 *xdg_toplevel;
   struct zxdg_popup_v6 *xdg_popup;
   struct zaura_surface *aura_surface;
   struct wl_list link;
+  struct wl_list dirty_link;
 };
 
 enum {
@@ -465,6 +526,9 @@ enum {
   ATOM_TARGETS,
   ATOM_TIMESTAMP,
   ATOM_TEXT,
+  ATOM_TEXT_HTML,
+  ATOM_TEXT_URI_LIST,
+  ATOM_IMAGE_PNG,
   ATOM_INCR,
   ATOM_WL_SELECTION,
   ATOM_LAST = ATOM_WL_SELECTION,
@@ -477,15 +541,66 @@ struct xwl_accelerator {
 };
 
 struct xwl_data_transfer {
+  struct xwl *xwl;
   int read_fd;
   int write_fd;
+  int pipe_fds[2];
+  int pipe_size;
   size_t offset;
   size_t bytes_left;
-  uint8_t data[4096];
+  uint8_t *data;
+  size_t size;
+  uint64_t bytes_transferred;
+  uint64_t start_time;
   struct wl_event_source *read_event_source;
   struct wl_event_source *write_event_source;
 };
 
+// Transfer of Wayland selection data to an X requestor. Transfers for the
+// same offer and type are fed from a shared receive buffer, each at its own
+// offset. Requests that can't share the current receive are queued.
+struct xwl_selection_transfer {
+  struct xwl *xwl;
+  struct wl_list link;
+  xcb_selection_request_event_t request;
+  int mime_type;
+  xcb_atom_t type;
+  int incremental;
+  int ack_pending;
+  size_t offset;
+  uint32_t chunk_size;
+  uint64_t send_time;
+};
+
+enum {
+  STARTUP_HOST_CONNECTED,
+  STARTUP_REGISTRY_COMPLETE,
+  STARTUP_XWAYLAND_READY,
+  STARTUP_WM_CONNECTED,
+  STARTUP_CHILD_SPAWNED,
+  STARTUP_FIRST_WINDOW_MAPPED,
+  STARTUP_FIRST_FRAME,
+  STARTUP_MILESTONE_COUNT,
+};
+
+struct xwl_control_client {
+  struct xwl *xwl;
+  int fd;
+  struct wl_event_source *event_source;
+  size_t length;
+  char buffer[1024];
+};
+
+struct xwl_stats {
+  uint64_t input_wait_count;
+  uint64_t input_wait_total_us;
+  uint64_t input_wait_max_us;
+  uint64_t bulk_bytes;
+  uint64_t bulk_deferred;
+  uint64_t virtwl_wakeups;
+  uint64_t virtwl_messages;
+};
+
 struct xwl {
   char **runprog;
   struct wl_display *display;
@@ -502,6 +617,7 @@ struct xwl {
   struct xwl_linux_dmabuf *linux_dmabuf;
   struct xwl_keyboard_extension *keyboard_extension;
   struct wl_list outputs;
+  struct wl_list host_outputs;
   struct wl_list seats;
   struct wl_event_source *display_event_source;
   struct wl_event_source *display_ready_event_source;
@@ -514,13 +630,32 @@ struct xwl {
   int virtwl_socket_fd;
   struct wl_event_source *virtwl_ctx_event_source;
   struct wl_event_source *virtwl_socket_event_source;
+  size_t virtwl_buffer_size;
+  uint8_t *virtwl_recv_buffer;
+  uint8_t *virtwl_send_buffer;
+  struct wl_list virtwl_pools;
+  size_t virtwl_pool_size;
+  size_t virtwl_pool_limit;
+  struct wl_list host_surfaces;
+  size_t output_buffer_bytes;
+  size_t output_buffer_limit;
+  int buffer_idle_timeout;
+  struct wl_event_source *buffer_trim_event_source;
   const char *drm_device;
   struct gbm_device *gbm;
   int xwayland;
   pid_t xwayland_pid;
   pid_t child_pid;
+  int child_ready_fd;
   pid_t peer_pid;
+  int worker_fd;
+  struct wl_event_source *worker_event_source;
+  struct wl_listener client_destroy_listener;
+  int pending_client_fd;
+  int registry_complete;
   struct xkb_context *xkb_context;
+  struct wl_list keymaps;
+  const char *keymap_cache;
   struct wl_list accelerators;
   struct wl_list registries;
   struct wl_list globals;
@@ -531,22 +666,35 @@ struct xwl {
   xcb_screen_t *screen;
   xcb_window_t window;
   struct wl_list windows, unpaired_windows;
+  struct wl_list dirty_windows;
   struct xwl_window *host_focus_window;
   int needs_set_input_focus;
   double desired_scale;
   double scale;
+  int native_scale;
   const char *app_id;
+  char *control_app_id;
   int exit_with_child;
   const char *sd_notify;
   int clipboard_manager;
   uint32_t frame_color;
   int has_frame_color;
   int show_window_title;
+  int configure_pacing;
+  int bulk_budget;
+  uint64_t input_check_time;
+  int stats_interval;
+  uint64_t startup_time;
+  uint64_t startup_milestones[STARTUP_MILESTONE_COUNT];
+  int startup_reported;
+  int trace_startup;
+  int startup_status;
+  struct wl_event_source *stats_event_source;
+  struct xwl_stats stats;
   struct xwl_host_seat *default_seat;
   xcb_window_t selection_window;
   xcb_window_t selection_owner;
   int selection_incremental_transfer;
-  xcb_selection_request_event_t selection_request;
   xcb_timestamp_t selection_timestamp;
   struct wl_data_device *selection_data_device;
   struct xwl_data_offer *selection_data_offer;
@@ -555,10 +703,23 @@ struct xwl {
   struct wl_event_source *selection_send_event_source;
   xcb_get_property_reply_t *selection_property_reply;
   int selection_property_offset;
+  uint32_t selection_property_long_offset;
+  xcb_get_property_cookie_t selection_property_cookie;
+  int selection_property_fetch_pending;
   struct wl_event_source *selection_event_source;
   struct wl_array selection_data;
+  size_t selection_data_base;
   int selection_data_offer_receive_fd;
-  int selection_data_ack_pending;
+  struct xwl_data_offer *selection_cache_offer;
+  int selection_cache_mime_type;
+  struct wl_list selection_transfers;
+  struct wl_list selection_queued_transfers;
+  struct wl_event_source *selection_transfer_event_source;
+  uint32_t selection_max_chunk_size;
+  size_t clipboard_prefetch_size;
+  int clipboard_prefetch_timeout;
+  int selection_prefetching;
+  struct wl_event_source *selection_prefetch_event_source;
   union {
     const char *name;
     xcb_intern_atom_cookie_t cookie;
@@ -568,7 +729,10 @@ struct xwl {
   xcb_colormap_t colormaps[256];
 };
 
+// _NET_WM_NAME takes precedence over WM_NAME and is listed first so that
+// it is always read before WM_NAME.
 enum {
+  PROPERTY_NET_WM_NAME,
   PROPERTY_WM_NAME,
   PROPERTY_WM_CLASS,
   PROPERTY_WM_TRANSIENT_FOR,
@@ -576,6 +740,7 @@ enum {
   PROPERTY_WM_CLIENT_LEADER,
   PROPERTY_MOTIF_WM_HINTS,
   PROPERTY_NET_STARTUP_ID,
+  PROPERTY_LAST = PROPERTY_NET_STARTUP_ID,
 };
 
 enum {
@@ -613,6 +778,29 @@ enum {
 #define MWM_DECOR_MINIMIZE (1L << 5)
 #define MWM_DECOR_MAXIMIZE (1L << 6)
 
+struct xwl_wm_size_hints {
+  uint32_t flags;
+  int32_t x, y;
+  int32_t width, height;
+  int32_t min_width, min_height;
+  int32_t max_width, max_height;
+  int32_t width_inc, height_inc;
+  struct {
+    int32_t x;
+    int32_t y;
+  } min_aspect, max_aspect;
+  int32_t base_width, base_height;
+  int32_t win_gravity;
+};
+
+struct xwl_mwm_hints {
+  uint32_t flags;
+  uint32_t functions;
+  uint32_t decorations;
+  int32_t input_mode;
+  uint32_t status;
+};
+
 #define NET_WM_MOVERESIZE_SIZE_TOPLEFT 0
 #define NET_WM_MOVERESIZE_SIZE_TOP 1
 #define NET_WM_MOVERESIZE_SIZE_TOPRIGHT 2
@@ -635,6 +823,70 @@ enum {
 
 #define CAPTION_HEIGHT 32
 
+#define CONFIGURE_PACING_TIMEOUT_MS 100
+
+#define POINTER_COALESCE_INTERVAL_MS 4
+
+// Bytes that clipboard transfers may move per event loop iteration before
+// yielding to input.
+#define BULK_BUDGET_PER_DISPATCH (256 * 1024)
+
+// Clipboard transfers that can't use splice() copy through a buffer that
+// grows between these sizes.
+#define DATA_TRANSFER_MIN_BUFFER_SIZE (64 * 1024)
+#define DATA_TRANSFER_MAX_BUFFER_SIZE (1024 * 1024)
+
+// X selection properties are read in chunks of this many bytes. Must be a
+// multiple of 4.
+#define SELECTION_PROPERTY_CHUNK_SIZE (64 * 1024)
+
+// Chunks of INCR transfers to X requestors grow up to this size while
+// requestors acknowledge them quickly, and shrink again when acks are slow.
+#define SELECTION_INCR_MAX_CHUNK_SIZE (1024 * 1024)
+#define SELECTION_INCR_FAST_ACK_US 10000
+#define SELECTION_INCR_SLOW_ACK_US 100000
+
+// Selection transfers are dropped when the requestor hasn't acknowledged an
+// INCR chunk, or the Wayland source hasn't provided all data for a single
+// property reply, within this many milliseconds.
+#define SELECTION_TRANSFER_TIMEOUT_MS 5000
+
+// Files that can be registered for removal at exit.
+#define MAX_EXIT_UNLINK_PATHS 4
+
+// Largest clipboard content kept in memory for repeated pastes.
+#define SELECTION_CACHE_MAX_SIZE (4 * 1024 * 1024)
+
+// Index of UTF-8 text in xwl_mime_types.
+#define MIME_TYPE_UTF8_TEXT 0
+
+// Clipboard prefetch is cancelled when no data arrives for this long.
+#define CLIPBOARD_PREFETCH_DEFAULT_TIMEOUT_MS 1000
+
+// Size of virtwl transaction buffers. Transactions that fit in the default
+// size use a buffer on the stack.
+#define VIRTWL_DEFAULT_BUFFER_SIZE 4096
+#define VIRTWL_MAX_BUFFER_SIZE (1024 * 1024)
+
+// Output buffers are sub-allocated from virtwl allocations of this size
+// when a pool limit is set. Larger buffers get an allocation of their own.
+// Pooling is off by default as each pool holds on to virtwl memory.
+#define VIRTWL_POOL_SIZE (32 * 1024 * 1024)
+#define VIRTWL_POOL_ALIGNMENT 4096
+#define VIRTWL_POOL_DEFAULT_LIMIT 0
+
+// Released output buffers of surfaces that have not committed for this
+// long are freed. A new buffer is allocated on the next attach.
+#define OUTPUT_BUFFER_DEFAULT_IDLE_TIMEOUT 10000
+
+// Number of compiled keymaps kept for reuse by keyboards.
+#define MAX_KEYMAP_CACHE_SIZE 8
+
+// Maximum number of pre-started workers kept by the master.
+#define MAX_WORKER_POOL_SIZE 64
+
+#define CONTROL_SOCKET_BACKLOG 4
+
 #define MIN_SCALE 0.1
 #define MAX_SCALE 10.0
 
@@ -656,6 +908,78 @@ enum {
 #define ALT_MASK (1 << 1)
 #define SHIFT_MASK (1 << 2)
 
+static uint64_t xwl_now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void xwl_sd_notify(const char *state) {
+  const char *socket_name;
+  struct msghdr msghdr;
+  struct iovec iovec;
+  struct sockaddr_un addr;
+  int fd;
+  int rv;
+
+  socket_name = getenv("NOTIFY_SOCKET");
+  assert(socket_name);
+
+  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  assert(fd >= 0);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_name, sizeof(addr.sun_path));
+
+  memset(&iovec, 0, sizeof(iovec));
+  iovec.iov_base = (char *)state;
+  iovec.iov_len = strlen(state);
+
+  memset(&msghdr, 0, sizeof(msghdr));
+  msghdr.msg_name = &addr;
+  msghdr.msg_namelen =
+      offsetof(struct sockaddr_un, sun_path) + strlen(socket_name);
+  msghdr.msg_iov = &iovec;
+  msghdr.msg_iovlen = 1;
+
+  // Also used for status updates during the session, so a notify socket
+  // that has gone away is reported rather than fatal.
+  rv = sendmsg(fd, &msghdr, MSG_NOSIGNAL);
+  if (rv == -1)
+    fprintf(stderr, "warning: failed to notify %s: %m\n", socket_name);
+  close(fd);
+}
+
+static const char *xwl_startup_milestone_names[] = {
+    "host connected",      "registry complete", "xwayland ready",
+    "wm connected",        "child spawned",     "first window mapped",
+    "first frame"};
+
+// Records the time since startup at which |milestone| was first reached.
+static void xwl_startup_milestone(struct xwl *xwl, int milestone) {
+  const char *name = xwl_startup_milestone_names[milestone];
+  uint64_t elapsed;
+
+  if (xwl->startup_milestones[milestone])
+    return;
+
+  // Zero means not reached.
+  elapsed = MAX(1, xwl_now_us() - xwl->startup_time);
+  xwl->startup_milestones[milestone] = elapsed;
+
+  if (xwl->trace_startup)
+    fprintf(stderr, "startup: %s after %" PRIu64 "us\n", name, elapsed);
+
+  if (xwl->startup_status) {
+    char status[64];
+
+    snprintf(status, sizeof(status), "STATUS=%s", name);
+    xwl_sd_notify(status);
+  }
+}
+
 struct dma_buf_sync {
   __u64 flags;
 };
@@ -701,6 +1025,7 @@ static struct xwl_mmap *xwl_mmap_create(int fd, size_t size, size_t offset,
   map->begin_access = NULL;
   map->end_access = NULL;
   map->buffer_resource = NULL;
+  map->parent = NULL;
   map->addr =
       mmap(NULL, size + offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   assert(map->addr != MAP_FAILED);
@@ -713,19 +1038,293 @@ static struct xwl_mmap *xwl_mmap_ref(struct xwl_mmap *map) {
   return map;
 }
 
+// Returns a map of |size| bytes at |offset| into the mapping of |parent|,
+// without mapping anything new.
+static struct xwl_mmap *xwl_mmap_create_view(struct xwl_mmap *parent,
+                                             size_t size, size_t offset,
+                                             size_t stride, size_t bpp) {
+  struct xwl_mmap *map;
+
+  map = malloc(sizeof(*map));
+  assert(map);
+  map->refcount = 1;
+  map->fd = parent->fd;
+  map->addr = parent->addr;
+  map->size = size;
+  map->offset = parent->offset + offset;
+  map->stride = stride;
+  map->bpp = bpp;
+  map->begin_access = NULL;
+  map->end_access = NULL;
+  map->buffer_resource = NULL;
+  map->parent = xwl_mmap_ref(parent);
+
+  return map;
+}
+
 static void xwl_mmap_unref(struct xwl_mmap *map) {
   if (map->refcount-- == 1) {
-    munmap(map->addr, map->size + map->offset);
-    close(map->fd);
+    if (map->parent) {
+      xwl_mmap_unref(map->parent);
+    } else {
+      munmap(map->addr, map->size + map->offset);
+      close(map->fd);
+    }
     free(map);
   }
 }
 
+static struct xwl_virtwl_pool *xwl_virtwl_pool_create(struct xwl *xwl,
+                                                      size_t size) {
+  struct virtwl_ioctl_new new_alloc = {
+      .type = VIRTWL_IOCTL_NEW_ALLOC, .fd = -1, .flags = 0, .size = size};
+  struct xwl_virtwl_pool *pool;
+  struct xwl_virtwl_block *block;
+  int rv;
+
+  rv = ioctl(xwl->virtwl_fd, VIRTWL_IOCTL_NEW, &new_alloc);
+  if (rv)
+    return NULL;
+
+  pool = malloc(sizeof(*pool));
+  assert(pool);
+  pool->xwl = xwl;
+  pool->fd = new_alloc.fd;
+  pool->size = size;
+  pool->used = 0;
+  pool->empty_time = xwl_now_us();
+  pool->proxy = wl_shm_create_pool(xwl->shm->internal, pool->fd, size);
+  // The pool is mapped once. Buffers are views into this mapping, which
+  // also owns the fd.
+  pool->mmap = xwl_mmap_create(pool->fd, size, 0, 0, 0);
+  wl_list_init(&pool->blocks);
+
+  block = malloc(sizeof(*block));
+  assert(block);
+  block->pool = pool;
+  block->offset = 0;
+  block->size = size;
+  block->busy = 0;
+  wl_list_insert(&pool->blocks, &block->link);
+
+  wl_list_insert(xwl->virtwl_pools.prev, &pool->link);
+  xwl->virtwl_pool_size += size;
+
+  return pool;
+}
+
+static void xwl_virtwl_pool_destroy(struct xwl_virtwl_pool *pool) {
+  struct xwl_virtwl_block *block, *next;
+
+  assert(!pool->used);
+
+  wl_list_for_each_safe(block, next, &pool->blocks, link) {
+    wl_list_remove(&block->link);
+    free(block);
+  }
+  wl_shm_pool_destroy(pool->proxy);
+  xwl_mmap_unref(pool->mmap);
+  pool->xwl->virtwl_pool_size -= pool->size;
+  wl_list_remove(&pool->link);
+  free(pool);
+}
+
+// First fit allocation from the blocks of |pool|, which are kept sorted by
+// offset.
+static struct xwl_virtwl_block *xwl_virtwl_pool_alloc(
+    struct xwl_virtwl_pool *pool, size_t size) {
+  struct xwl_virtwl_block *block, *remainder;
+
+  wl_list_for_each(block, &pool->blocks, link) {
+    if (block->busy || block->size < size)
+      continue;
+
+    if (block->size > size) {
+      remainder = malloc(sizeof(*remainder));
+      assert(remainder);
+      remainder->pool = pool;
+      remainder->offset = block->offset + size;
+      remainder->size = block->size - size;
+      remainder->busy = 0;
+      wl_list_insert(&block->link, &remainder->link);
+      block->size = size;
+    }
+
+    block->busy = 1;
+    pool->used += size;
+    return block;
+  }
+
+  return NULL;
+}
+
+// Returns a block of at least |size| bytes, or NULL if the arena would grow
+// beyond its limit. Empty pools are released before giving up.
+static struct xwl_virtwl_block *xwl_virtwl_alloc(struct xwl *xwl,
+                                                 size_t size) {
+  struct xwl_virtwl_pool *pool, *next;
+  struct xwl_virtwl_block *block;
+
+  size = (size + VIRTWL_POOL_ALIGNMENT - 1) & ~(VIRTWL_POOL_ALIGNMENT - 1);
+  if (size > VIRTWL_POOL_SIZE)
+    return NULL;
+
+  wl_list_for_each(pool, &xwl->virtwl_pools, link) {
+    block = xwl_virtwl_pool_alloc(pool, size);
+    if (block)
+      return block;
+  }
+
+  if (xwl->virtwl_pool_size + VIRTWL_POOL_SIZE > xwl->virtwl_pool_limit) {
+    wl_list_for_each_safe(pool, next, &xwl->virtwl_pools, link) {
+      if (!pool->used)
+        xwl_virtwl_pool_destroy(pool);
+    }
+    if (xwl->virtwl_pool_size + VIRTWL_POOL_SIZE > xwl->virtwl_pool_limit)
+      return NULL;
+  }
+
+  pool = xwl_virtwl_pool_create(xwl, VIRTWL_POOL_SIZE);
+  if (!pool)
+    return NULL;
+
+  return xwl_virtwl_pool_alloc(pool, size);
+}
+
+static void xwl_virtwl_free(struct xwl_virtwl_block *block) {
+  struct xwl_virtwl_pool *pool = block->pool;
+  struct xwl_virtwl_block *next, *prev;
+
+  block->busy = 0;
+  pool->used -= block->size;
+
+  // Merge with free neighbours.
+  if (block->link.next != &pool->blocks) {
+    next = wl_container_of(block->link.next, next, link);
+    if (!next->busy) {
+      block->size += next->size;
+      wl_list_remove(&next->link);
+      free(next);
+    }
+  }
+  if (block->link.prev != &pool->blocks) {
+    prev = wl_container_of(block->link.prev, prev, link);
+    if (!prev->busy) {
+      prev->size += block->size;
+      wl_list_remove(&block->link);
+      free(block);
+    }
+  }
+
+  // Keep the first pool around to avoid churn when a single surface
+  // replaces its buffers, but release any other pool once it is empty.
+  // The first pool is released by the buffer trim timer once it has been
+  // empty for the idle timeout.
+  if (!pool->used) {
+    if (pool->link.prev != &pool->xwl->virtwl_pools)
+      xwl_virtwl_pool_destroy(pool);
+    else
+      pool->empty_time = xwl_now_us();
+  }
+}
+
 static void xwl_output_buffer_destroy(struct xwl_output_buffer *buffer) {
+  struct xwl_host_surface *host_surface = buffer->surface;
+
+  host_surface->buffer_bytes -= buffer->mmap->size;
+  host_surface->xwl->output_buffer_bytes -= buffer->mmap->size;
   wl_buffer_destroy(buffer->internal);
   xwl_mmap_unref(buffer->mmap);
+  if (buffer->block)
+    xwl_virtwl_free(buffer->block);
   pixman_region32_fini(&buffer->damage);
   wl_list_remove(&buffer->link);
+  free(buffer);
+}
+
+// Frees the released output buffers of |host|. Busy buffers are still in
+// use by the host and are left alone.
+static void xwl_host_surface_trim_buffers(struct xwl_host_surface *host) {
+  struct xwl_output_buffer *buffer, *next;
+
+  wl_list_for_each_safe(buffer, next, &host->released_buffers, link) {
+    if (buffer == host->current_buffer) {
+      // Keep the buffer that the pending commit will copy into.
+      if (host->contents_shm_mmap)
+        continue;
+      host->current_buffer = NULL;
+    }
+    xwl_output_buffer_destroy(buffer);
+  }
+}
+
+// Trims surfaces in least recently committed order until output buffers
+// fit within the limit. Replacement buffers start out fully damaged.
+static void xwl_evict_output_buffers(struct xwl *xwl) {
+  struct xwl_host_surface *host;
+
+  wl_list_for_each_reverse(host, &xwl->host_surfaces, link) {
+    if (xwl->output_buffer_bytes <= xwl->output_buffer_limit)
+      break;
+    xwl_host_surface_trim_buffers(host);
+  }
+}
+
+// Scale for X11 contents shown on |host|. The configured scale applies to
+// the least dense output, so it keeps its meaning when a single output is
+// present, and denser outputs use a proportionally higher scale so that
+// contents are rendered at their density.
+static double xwl_host_output_scale(struct xwl_host_output *host) {
+  struct xwl *xwl = host->output->xwl;
+  struct xwl_host_output *other;
+  int min_scale_factor = host->scale_factor;
+
+  // Integer buffer scale is all we can do without wp_viewporter.
+  if (!xwl->xwayland || !xwl->viewporter)
+    return xwl->scale;
+
+  // Native mode maps X11 pixels 1:1 to host pixels. The host reports its
+  // logical size as the current scale relative to the max scale.
+  if (xwl->native_scale && host->aura_output) {
+    int max_aura_scale_factor = host->max_scale / 1000.0;
+
+    return MIN(MAX_SCALE, MAX(MIN_SCALE, max_aura_scale_factor * 1000.0 /
+                                             host->last_current_scale));
+  }
+
+  if (host->scale_factor < 1)
+    return xwl->scale;
+
+  wl_list_for_each(other, &xwl->host_outputs, link) {
+    if (other->scale_factor >= 1)
+      min_scale_factor = MIN(min_scale_factor, other->scale_factor);
+  }
+
+  return MIN(MAX_SCALE, xwl->scale * host->scale_factor / min_scale_factor);
+}
+
+static double xwl_host_surface_scale(struct xwl_host_surface *host) {
+  return host->output ? xwl_host_output_scale(host->output) : host->xwl->scale;
+}
+
+// Scale for events relative to |surface_resource|, which may be NULL.
+static double xwl_resource_scale(struct xwl *xwl,
+                                 struct wl_resource *surface_resource) {
+  struct xwl_host_surface *host_surface =
+      surface_resource ? wl_resource_get_user_data(surface_resource) : NULL;
+
+  return host_surface ? xwl_host_surface_scale(host_surface) : xwl->scale;
+}
+
+static double xwl_window_scale(struct xwl_window *window) {
+  struct wl_resource *host_resource = NULL;
+
+  if (window->host_surface_id) {
+    host_resource =
+        wl_client_get_object(window->xwl->client, window->host_surface_id);
+  }
+
+  return xwl_resource_scale(window->xwl, host_resource);
 }
 
 static void xwl_output_buffer_release(void *data, struct wl_buffer *buffer) {
@@ -890,6 +1489,19 @@ static void xwl_roundtrip(struct xwl *xwl) {
                                  xcb_get_input_focus(xwl->connection), NULL));
 }
 
+static const struct wl_callback_listener xwl_window_frame_callback_listener;
+
+static void xwl_window_request_frame(struct xwl_window *window,
+                                     struct xwl_host_surface *host_surface) {
+  window->frame_callback = wl_surface_frame(host_surface->proxy);
+  wl_callback_set_user_data(window->frame_callback, window);
+  wl_callback_add_listener(window->frame_callback,
+                           &xwl_window_frame_callback_listener, window);
+
+  wl_event_source_timer_update(window->frame_timeout_event_source,
+                               CONFIGURE_PACING_TIMEOUT_MS);
+}
+
 static int
 xwl_process_pending_configure_acks(struct xwl_window *window,
                                    struct xwl_host_surface *host_surface) {
@@ -913,35 +1525,82 @@ xwl_process_pending_configure_acks(struct xwl_window *window,
   }
   window->pending_config.serial = 0;
 
-  if (window->next_config.serial)
+  // When pacing, further configures are held until the host has presented
+  // the contents for this one. The frame callback is part of the commit
+  // that follows the ack.
+  if (window->xwl->configure_pacing && host_surface && !window->frame_callback)
+    xwl_window_request_frame(window, host_surface);
+
+  if ((window->next_config.serial || window->next_config.mask) &&
+      !window->frame_callback) {
     xwl_configure_window(window);
+  }
 
   return 1;
 }
 
-static void xwl_internal_xdg_surface_configure(
-    void *data, struct zxdg_surface_v6 *xdg_surface, uint32_t serial) {
-  struct xwl_window *window = zxdg_surface_v6_get_user_data(xdg_surface);
+// Applies the next configure unless the previous one is still in flight.
+static void xwl_window_configure_next(struct xwl_window *window) {
+  struct wl_resource *host_resource;
+  struct xwl_host_surface *host_surface = NULL;
 
-  window->next_config.serial = serial;
-  if (!window->pending_config.serial) {
-    struct wl_resource *host_resource;
-    struct xwl_host_surface *host_surface = NULL;
+  if (window->pending_config.serial || window->frame_callback)
+    return;
 
-    host_resource =
-        wl_client_get_object(window->xwl->client, window->host_surface_id);
-    if (host_resource)
-      host_surface = wl_resource_get_user_data(host_resource);
+  host_resource =
+      wl_client_get_object(window->xwl->client, window->host_surface_id);
+  if (host_resource)
+    host_surface = wl_resource_get_user_data(host_resource);
 
-    xwl_configure_window(window);
+  xwl_configure_window(window);
 
-    if (xwl_process_pending_configure_acks(window, host_surface)) {
-      if (host_surface)
-        wl_surface_commit(host_surface->proxy);
-    }
+  if (xwl_process_pending_configure_acks(window, host_surface)) {
+    if (host_surface)
+      wl_surface_commit(host_surface->proxy);
   }
 }
 
+static void xwl_window_cancel_frame(struct xwl_window *window) {
+  if (window->frame_callback) {
+    wl_callback_destroy(window->frame_callback);
+    window->frame_callback = NULL;
+  }
+  if (window->frame_timeout_event_source)
+    wl_event_source_timer_update(window->frame_timeout_event_source, 0);
+}
+
+static void xwl_window_release_configure(struct xwl_window *window) {
+  xwl_window_cancel_frame(window);
+
+  // The latest configure received while waiting wins.
+  if (window->next_config.serial || window->next_config.mask)
+    xwl_window_configure_next(window);
+}
+
+static void xwl_window_frame_callback_done(void *data,
+                                           struct wl_callback *callback,
+                                           uint32_t time) {
+  xwl_window_release_configure(wl_callback_get_user_data(callback));
+}
+
+static const struct wl_callback_listener xwl_window_frame_callback_listener = {
+    xwl_window_frame_callback_done};
+
+// Frame callbacks are not guaranteed to be delivered for hidden surfaces so
+// don't hold configures forever.
+static int xwl_window_handle_frame_timeout(void *data) {
+  xwl_window_release_configure(data);
+  return 0;
+}
+
+static void xwl_internal_xdg_surface_configure(
+    void *data, struct zxdg_surface_v6 *xdg_surface, uint32_t serial) {
+  struct xwl_window *window = zxdg_surface_v6_get_user_data(xdg_surface);
+
+  window->next_config.serial = serial;
+  xwl_window_configure_next(window);
+}
+
 static const struct zxdg_surface_v6_listener xwl_internal_xdg_surface_listener =
     {xwl_internal_xdg_surface_configure};
 
@@ -957,10 +1616,13 @@ static void xwl_internal_xdg_toplevel_configure(
     return;
 
   if (width && height) {
-    int32_t width_in_pixels = width * window->xwl->scale;
-    int32_t height_in_pixels = height * window->xwl->scale;
+    double scale = xwl_window_scale(window);
+    int32_t width_in_pixels = width * scale;
+    int32_t height_in_pixels = height * scale;
     int i = 0;
 
+    window->scale = scale;
+
     window->next_config.mask = XCB_CONFIG_WINDOW_WIDTH |
                                XCB_CONFIG_WINDOW_HEIGHT |
                                XCB_CONFIG_WINDOW_BORDER_WIDTH;
@@ -1030,26 +1692,91 @@ static const struct zxdg_toplevel_v6_listener
     xwl_internal_xdg_toplevel_listener = {xwl_internal_xdg_toplevel_configure,
                                           xwl_internal_xdg_toplevel_close};
 
-static void xwl_internal_xdg_popup_configure(void *data,
-                                             struct zxdg_popup_v6 *xdg_popup,
-                                             int32_t x, int32_t y,
-                                             int32_t width, int32_t height) {
-  DEBUG_PRINT;
-
-  struct xwl_window *window = data;
-
-  // zxdg_popup_v6_send_configure(xdg_popup, x, y, x + width, y + height);
-}
+// Resizes |window| when the scale of its contents changes, e.g. when it
+// moves to an output with another scale factor, so that it keeps its size
+// on the host and is rendered at the new density.
+static void xwl_window_update_scale(struct xwl_window *window) {
+  double scale = xwl_window_scale(window);
+  double factor = scale / window->scale;
+  int32_t width_in_pixels, height_in_pixels;
+  int i = 0;
 
-static void xwl_internal_xdg_popup_done(void *data,
-                                        struct zxdg_popup_v6 *zxdg_popup_v6) {
-  DEBUG_PRINT;
-}
+  if (scale == window->scale)
+    return;
 
-static const struct zxdg_popup_v6_listener xwl_internal_xdg_popup_listener = {
-    xwl_internal_xdg_popup_configure, xwl_internal_xdg_popup_done};
+  window->scale = scale;
+  if (!window->managed || !window->xdg_toplevel)
+    return;
 
-static void xwl_window_set_wm_state(struct xwl_window *window, int state) {
+  // A size from the host that has not been applied yet is rescaled.
+  // Otherwise the current size is, keeping the current states.
+  if (!(window->next_config.mask & XCB_CONFIG_WINDOW_WIDTH)) {
+    window->next_config.mask = XCB_CONFIG_WINDOW_WIDTH |
+                               XCB_CONFIG_WINDOW_HEIGHT |
+                               XCB_CONFIG_WINDOW_BORDER_WIDTH;
+    if (!(window->size_flags & (US_POSITION | P_POSITION))) {
+      window->next_config.mask |= XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y;
+      window->next_config.values[i++] = window->x;
+      window->next_config.values[i++] = window->y;
+    }
+    window->next_config.values[i++] = window->width;
+    window->next_config.values[i++] = window->height;
+    window->next_config.values[i++] = 0;
+
+    if (!window->next_config.serial) {
+      memcpy(window->next_config.states, window->pending_config.states,
+             sizeof(window->next_config.states));
+      window->next_config.states_length = window->pending_config.states_length;
+    }
+  }
+
+  i = 0;
+  if (window->next_config.mask & XCB_CONFIG_WINDOW_X)
+    ++i;
+  if (window->next_config.mask & XCB_CONFIG_WINDOW_Y)
+    ++i;
+  width_in_pixels = window->next_config.values[i] * factor;
+  height_in_pixels = window->next_config.values[i + 1] * factor;
+  window->next_config.values[i] = width_in_pixels;
+  window->next_config.values[i + 1] = height_in_pixels;
+  if (i) {
+    window->next_config.values[0] =
+        window->xwl->screen->width_in_pixels / 2 - width_in_pixels / 2;
+    window->next_config.values[1] =
+        window->xwl->screen->height_in_pixels / 2 - height_in_pixels / 2;
+  }
+
+  // Applied once configures in flight are done.
+  xwl_window_configure_next(window);
+}
+
+static void xwl_update_window_scales(struct xwl *xwl) {
+  struct xwl_window *window;
+
+  wl_list_for_each(window, &xwl->windows, link)
+    xwl_window_update_scale(window);
+}
+
+static void xwl_internal_xdg_popup_configure(void *data,
+                                             struct zxdg_popup_v6 *xdg_popup,
+                                             int32_t x, int32_t y,
+                                             int32_t width, int32_t height) {
+  DEBUG_PRINT;
+
+  struct xwl_window *window = data;
+
+  // zxdg_popup_v6_send_configure(xdg_popup, x, y, x + width, y + height);
+}
+
+static void xwl_internal_xdg_popup_done(void *data,
+                                        struct zxdg_popup_v6 *zxdg_popup_v6) {
+  DEBUG_PRINT;
+}
+
+static const struct zxdg_popup_v6_listener xwl_internal_xdg_popup_listener = {
+    xwl_internal_xdg_popup_configure, xwl_internal_xdg_popup_done};
+
+static void xwl_window_set_wm_state(struct xwl_window *window, int state) {
   struct xwl *xwl = window->xwl;
   uint32_t values[2];
 
@@ -1061,6 +1788,30 @@ static void xwl_window_set_wm_state(struct xwl_window *window, int state) {
                       xwl->atoms[ATOM_WM_STATE].value, 32, 2, values);
 }
 
+static uint32_t xwl_window_frame_type(struct xwl_window *window) {
+  if (window->decorated)
+    return ZAURA_SURFACE_FRAME_TYPE_NORMAL;
+
+  return window->depth == 32 ? ZAURA_SURFACE_FRAME_TYPE_NONE
+                             : ZAURA_SURFACE_FRAME_TYPE_SHADOW;
+}
+
+// Returns the window |window| is transient for if it has a toplevel.
+static struct xwl_window *xwl_window_transient_parent(
+    struct xwl_window *window) {
+  struct xwl_window *sibling;
+
+  if (window->transient_for == XCB_WINDOW_NONE)
+    return NULL;
+
+  wl_list_for_each(sibling, &window->xwl->windows, link) {
+    if (sibling->id == window->transient_for)
+      return sibling->xdg_toplevel ? sibling : NULL;
+  }
+
+  return NULL;
+}
+
 static void xwl_window_update(struct xwl_window *window) {
   struct wl_resource *host_resource = NULL;
   struct xwl_host_surface *host_surface;
@@ -1083,6 +1834,7 @@ static void xwl_window_update(struct xwl_window *window) {
   }
 
   if (!host_resource) {
+    xwl_window_cancel_frame(window);
     if (window->aura_surface) {
       zaura_surface_destroy(window->aura_surface);
       window->aura_surface = NULL;
@@ -1112,18 +1864,7 @@ static void xwl_window_update(struct xwl_window *window) {
 
   if (window->managed) {
     app_id = xwl->app_id ? xwl->app_id : window->clazz;
-
-    if (window->transient_for != XCB_WINDOW_NONE) {
-      struct xwl_window *sibling;
-
-      wl_list_for_each(sibling, &xwl->windows, link) {
-        if (sibling->id == window->transient_for) {
-          if (sibling->xdg_toplevel)
-            parent = sibling;
-          break;
-        }
-      }
-    }
+    parent = xwl_window_transient_parent(window);
   } else {
     struct xwl_window *sibling;
     uint32_t parent_last_event_serial = 0;
@@ -1165,6 +1906,7 @@ static void xwl_window_update(struct xwl_window *window) {
     zxdg_surface_v6_set_user_data(window->xdg_surface, window);
     zxdg_surface_v6_add_listener(window->xdg_surface,
                                  &xwl_internal_xdg_surface_listener, window);
+    xwl_startup_milestone(xwl, STARTUP_FIRST_WINDOW_MAPPED);
   }
 
   if (xwl->aura_shell) {
@@ -1173,11 +1915,7 @@ static void xwl_window_update(struct xwl_window *window) {
           xwl->aura_shell->internal, host_surface->proxy);
     }
     zaura_surface_set_frame(window->aura_surface,
-                            window->decorated
-                                ? ZAURA_SURFACE_FRAME_TYPE_NORMAL
-                                : window->depth == 32
-                                      ? ZAURA_SURFACE_FRAME_TYPE_NONE
-                                      : ZAURA_SURFACE_FRAME_TYPE_SHADOW);
+                            xwl_window_frame_type(window));
 
     if (xwl->has_frame_color &&
         xwl->aura_shell->version >=
@@ -1205,6 +1943,7 @@ static void xwl_window_update(struct xwl_window *window) {
       zxdg_toplevel_v6_set_app_id(window->xdg_toplevel, app_id);
   } else if (!window->xdg_popup) {
     struct zxdg_positioner_v6 *positioner;
+    double scale = xwl_window_scale(parent);
     DEBUG_PRINT;
 
     positioner = zxdg_shell_v6_create_positioner(xwl->xdg_shell->internal);
@@ -1216,8 +1955,8 @@ static void xwl_window_update(struct xwl_window *window) {
                                    ZXDG_POSITIONER_V6_GRAVITY_BOTTOM |
                                        ZXDG_POSITIONER_V6_GRAVITY_RIGHT);
     zxdg_positioner_v6_set_anchor_rect(
-        positioner, (window->x - parent->x) / xwl->scale,
-        (window->y - parent->y) / xwl->scale, 1, 1);
+        positioner, (window->x - parent->x) / scale,
+        (window->y - parent->y) / scale, 1, 1);
 
     zxdg_positioner_v6_set_size(positioner, 1, 1);
 
@@ -1233,9 +1972,11 @@ static void xwl_window_update(struct xwl_window *window) {
   if ((window->size_flags & (US_POSITION | P_POSITION)) && parent &&
       xwl->aura_shell &&
       xwl->aura_shell->version >= ZAURA_SURFACE_SET_PARENT_SINCE_VERSION) {
+    double scale = xwl_window_scale(parent);
+
     zaura_surface_set_parent(window->aura_surface, parent->aura_surface,
-                             (window->x - parent->x) / xwl->scale,
-                             (window->y - parent->y) / xwl->scale);
+                             (window->x - parent->x) / scale,
+                             (window->y - parent->y) / scale);
   }
 
   wl_surface_commit(host_surface->proxy);
@@ -1303,18 +2044,127 @@ static uint32_t xwl_drm_format_for_shm_format(int format) {
   return 0;
 }
 
+// Returns false if bulk transfers have used up their budget for this event
+// loop iteration. Deferred transfers continue in the next iteration after
+// pending input has been handled.
+static int xwl_bulk_budget_available(struct xwl *xwl) {
+  if (xwl->bulk_budget > 0)
+    return 1;
+
+  ++xwl->stats.bulk_deferred;
+  return 0;
+}
+
+static void xwl_bulk_budget_consume(struct xwl *xwl, int bytes) {
+  if (bytes <= 0)
+    return;
+
+  xwl->bulk_budget -= bytes;
+  xwl->stats.bulk_bytes += bytes;
+}
+
 static void xwl_data_transfer_destroy(struct xwl_data_transfer *transfer) {
+  if (transfer->xwl->stats_interval) {
+    uint64_t duration_us = xwl_now_us() - transfer->start_time;
+
+    fprintf(stderr,
+            "stats: transfer %" PRIu64 " bytes in %" PRIu64 " us "
+            "(%" PRIu64 " KiB/s, %s)\n",
+            transfer->bytes_transferred, duration_us,
+            transfer->bytes_transferred * 1000000 / 1024 /
+                (duration_us ? duration_us : 1),
+            transfer->pipe_fds[0] >= 0 ? "splice" : "copy");
+  }
+
   if (transfer->read_event_source)
     wl_event_source_remove(transfer->read_event_source);
   assert(transfer->write_event_source);
   wl_event_source_remove(transfer->write_event_source);
   close(transfer->read_fd);
   close(transfer->write_fd);
+  if (transfer->pipe_fds[0] >= 0) {
+    close(transfer->pipe_fds[0]);
+    close(transfer->pipe_fds[1]);
+  }
+  free(transfer->data);
   free(transfer);
 }
 
+static void xwl_data_transfer_reserve(struct xwl_data_transfer *transfer,
+                                      size_t size) {
+  if (transfer->size >= size)
+    return;
+
+  transfer->data = realloc(transfer->data, size);
+  assert(transfer->data);
+  transfer->size = size;
+}
+
+// Stops splicing and moves any data held by the intermediate pipe into the
+// copy buffer. Used when one end of the transfer turns out to not support
+// splice().
+static void xwl_data_transfer_stop_splice(struct xwl_data_transfer *transfer) {
+  size_t size = 0;
+  ssize_t rv;
+
+  xwl_data_transfer_reserve(
+      transfer, MAX(transfer->bytes_left, DATA_TRANSFER_MIN_BUFFER_SIZE));
+  while (size < transfer->bytes_left) {
+    rv = read(transfer->pipe_fds[0], transfer->data + size,
+              transfer->bytes_left - size);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    assert(rv > 0);
+    size += rv;
+  }
+  close(transfer->pipe_fds[0]);
+  close(transfer->pipe_fds[1]);
+  transfer->pipe_fds[0] = transfer->pipe_fds[1] = -1;
+  transfer->offset = 0;
+}
+
+static ssize_t xwl_data_transfer_fill(struct xwl_data_transfer *transfer) {
+  ssize_t rv;
+
+  if (transfer->pipe_fds[1] >= 0) {
+    rv = splice(transfer->read_fd, NULL, transfer->pipe_fds[1], NULL,
+                transfer->pipe_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (rv >= 0 || errno != EINVAL)
+      return rv;
+
+    // Pipe is empty at this point so no data needs to be moved.
+    xwl_data_transfer_stop_splice(transfer);
+  }
+
+  rv = read(transfer->read_fd, transfer->data, transfer->size);
+
+  // Grow the buffer while the source keeps filling it, so large transfers
+  // need fewer wakeups. Data already read is preserved by realloc().
+  if (rv == transfer->size && transfer->size < DATA_TRANSFER_MAX_BUFFER_SIZE)
+    xwl_data_transfer_reserve(transfer, transfer->size * 2);
+
+  return rv;
+}
+
+static ssize_t xwl_data_transfer_drain(struct xwl_data_transfer *transfer) {
+  ssize_t rv;
+
+  if (transfer->pipe_fds[0] >= 0) {
+    rv = splice(transfer->pipe_fds[0], NULL, transfer->write_fd, NULL,
+                transfer->bytes_left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (rv >= 0 || errno != EINVAL)
+      return rv;
+
+    xwl_data_transfer_stop_splice(transfer);
+  }
+
+  return write(transfer->write_fd, transfer->data + transfer->offset,
+               transfer->bytes_left);
+}
+
 static int xwl_handle_data_transfer_read(int fd, uint32_t mask, void *data) {
   struct xwl_data_transfer *transfer = (struct xwl_data_transfer *)data;
+  ssize_t rv;
 
   if ((mask & WL_EVENT_READABLE) == 0) {
     assert(mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR));
@@ -1325,9 +2175,17 @@ static int xwl_handle_data_transfer_read(int fd, uint32_t mask, void *data) {
 
   assert(!transfer->bytes_left);
 
-  transfer->bytes_left =
-      read(transfer->read_fd, transfer->data, sizeof(transfer->data));
-  if (transfer->bytes_left) {
+  if (!xwl_bulk_budget_available(transfer->xwl))
+    return 0;
+
+  rv = xwl_data_transfer_fill(transfer);
+  if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+
+  xwl_bulk_budget_consume(transfer->xwl, rv);
+  if (rv > 0) {
+    transfer->bytes_left = rv;
+    transfer->bytes_transferred += rv;
     transfer->offset = 0;
     wl_event_source_fd_update(transfer->read_event_source, 0);
     wl_event_source_fd_update(transfer->write_event_source, WL_EVENT_WRITABLE);
@@ -1340,7 +2198,7 @@ static int xwl_handle_data_transfer_read(int fd, uint32_t mask, void *data) {
 
 static int xwl_handle_data_transfer_write(int fd, uint32_t mask, void *data) {
   struct xwl_data_transfer *transfer = (struct xwl_data_transfer *)data;
-  int rv;
+  ssize_t rv;
 
   if ((mask & WL_EVENT_WRITABLE) == 0) {
     assert(mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR));
@@ -1350,8 +2208,11 @@ static int xwl_handle_data_transfer_write(int fd, uint32_t mask, void *data) {
 
   assert(transfer->bytes_left);
 
-  rv = write(transfer->write_fd, transfer->data + transfer->offset,
-             transfer->bytes_left);
+  if (!xwl_bulk_budget_available(transfer->xwl))
+    return 0;
+
+  rv = xwl_data_transfer_drain(transfer);
+  xwl_bulk_budget_consume(transfer->xwl, rv);
 
   if (rv < 0) {
     assert(errno == EAGAIN || errno == EWOULDBLOCK || errno == EPIPE);
@@ -1374,8 +2235,10 @@ static int xwl_handle_data_transfer_write(int fd, uint32_t mask, void *data) {
   return 1;
 }
 
-static void xwl_data_transfer_create(struct wl_event_loop *event_loop,
-                                     int read_fd, int write_fd) {
+static void xwl_data_transfer_create(struct xwl *xwl, int read_fd,
+                                     int write_fd) {
+  struct wl_event_loop *event_loop =
+      wl_display_get_event_loop(xwl->host_display);
   struct xwl_data_transfer *transfer;
   int flags;
   int rv;
@@ -1386,10 +2249,34 @@ static void xwl_data_transfer_create(struct wl_event_loop *event_loop,
 
   transfer = malloc(sizeof(*transfer));
   assert(transfer);
+  transfer->xwl = xwl;
   transfer->read_fd = read_fd;
   transfer->write_fd = write_fd;
   transfer->offset = 0;
   transfer->bytes_left = 0;
+  transfer->data = NULL;
+  transfer->size = 0;
+  transfer->bytes_transferred = 0;
+  transfer->start_time = xwl_now_us();
+
+  // Data is moved through an intermediate pipe with splice() when possible
+  // to avoid copying it through user space. The copy buffer is only
+  // allocated if splicing fails.
+  rv = pipe2(transfer->pipe_fds, O_CLOEXEC | O_NONBLOCK);
+  if (!rv) {
+    fcntl(transfer->pipe_fds[1], F_SETPIPE_SZ, DATA_TRANSFER_MAX_BUFFER_SIZE);
+    transfer->pipe_size = fcntl(transfer->pipe_fds[1], F_GETPIPE_SZ);
+    if (transfer->pipe_size <= 0) {
+      close(transfer->pipe_fds[0]);
+      close(transfer->pipe_fds[1]);
+      rv = -1;
+    }
+  }
+  if (rv) {
+    transfer->pipe_fds[0] = transfer->pipe_fds[1] = -1;
+    xwl_data_transfer_reserve(transfer, DATA_TRANSFER_MIN_BUFFER_SIZE);
+  }
+
   transfer->read_event_source =
       wl_event_loop_add_fd(event_loop, read_fd, WL_EVENT_READABLE,
                            xwl_handle_data_transfer_read, transfer);
@@ -1411,7 +2298,7 @@ static void xwl_host_surface_attach(struct wl_client *client,
       buffer_resource ? wl_resource_get_user_data(buffer_resource) : NULL;
   struct wl_buffer *buffer_proxy = NULL;
   struct xwl_window *window;
-  double scale = host->xwl->scale;
+  double scale = xwl_host_surface_scale(host);
 
   host->current_buffer = NULL;
   if (host->contents_shm_mmap) {
@@ -1457,6 +2344,7 @@ static void xwl_host_surface_attach(struct wl_client *client,
       host->current_buffer->height = height;
       host->current_buffer->format = shm_format;
       host->current_buffer->surface = host;
+      host->current_buffer->block = NULL;
       pixman_region32_init_rect(&host->current_buffer->damage, 0, 0, MAX_SIZE,
                                 MAX_SIZE);
 
@@ -1492,18 +2380,33 @@ static void xwl_host_surface_attach(struct wl_client *client,
       case SHM_DRIVER_VIRTWL: {
         struct virtwl_ioctl_new new_alloc = {
             .type = VIRTWL_IOCTL_NEW_ALLOC, .fd = -1, .flags = 0, .size = size};
+        size_t stride = host_buffer->shm_mmap->stride;
+        struct xwl_virtwl_block *block = NULL;
         struct wl_shm_pool *pool;
         int rv;
 
+        if (host->xwl->virtwl_pool_limit)
+          block = xwl_virtwl_alloc(host->xwl, size);
+
+        if (block) {
+          host->current_buffer->block = block;
+          host->current_buffer->internal = wl_shm_pool_create_buffer(
+              block->pool->proxy, block->offset, width, height, stride,
+              shm_format);
+          host->current_buffer->mmap = xwl_mmap_create_view(
+              block->pool->mmap, size, block->offset, stride, bpp);
+          break;
+        }
+
         rv = ioctl(host->xwl->virtwl_fd, VIRTWL_IOCTL_NEW, &new_alloc);
         assert(rv == 0);
 
         pool = wl_shm_create_pool(host->xwl->shm->internal, new_alloc.fd, size);
         host->current_buffer->internal = wl_shm_pool_create_buffer(
-            pool, 0, width, height, host_buffer->shm_mmap->stride, shm_format);
+            pool, 0, width, height, stride, shm_format);
 
-        host->current_buffer->mmap = xwl_mmap_create(
-            new_alloc.fd, size, 0, host_buffer->shm_mmap->stride, bpp);
+        host->current_buffer->mmap =
+            xwl_mmap_create(new_alloc.fd, size, 0, stride, bpp);
 
         wl_shm_pool_destroy(pool);
       } break;
@@ -1516,6 +2419,13 @@ static void xwl_host_surface_attach(struct wl_client *client,
                               host->current_buffer);
       wl_buffer_add_listener(host->current_buffer->internal,
                              &xwl_output_buffer_listener, host->current_buffer);
+
+      host->buffer_bytes += host->current_buffer->mmap->size;
+      host->xwl->output_buffer_bytes += host->current_buffer->mmap->size;
+      if (host->xwl->output_buffer_limit &&
+          host->xwl->output_buffer_bytes > host->xwl->output_buffer_limit) {
+        xwl_evict_output_buffers(host->xwl);
+      }
     }
   }
 
@@ -1543,7 +2453,7 @@ static void xwl_host_surface_damage(struct wl_client *client,
                                     struct wl_resource *resource, int32_t x,
                                     int32_t y, int32_t width, int32_t height) {
   struct xwl_host_surface *host = wl_resource_get_user_data(resource);
-  double scale = host->xwl->scale;
+  double scale = xwl_host_surface_scale(host);
   struct xwl_output_buffer *buffer;
   int64_t x1, y1, x2, y2;
 
@@ -1638,6 +2548,11 @@ static void xwl_host_surface_commit(struct wl_client *client,
   struct xwl_host_surface *host = wl_resource_get_user_data(resource);
   struct xwl_window *window;
 
+  // Keep surfaces ordered by last commit, most recent first.
+  host->last_commit_time = xwl_now_us();
+  wl_list_remove(&host->link);
+  wl_list_insert(&host->xwl->host_surfaces, &host->link);
+
   if (host->contents_shm_mmap) {
     uint8_t *src_base =
         host->contents_shm_mmap->addr + host->contents_shm_mmap->offset;
@@ -1693,7 +2608,7 @@ static void xwl_host_surface_commit(struct wl_client *client,
   }
 
   if (host->contents_width && host->contents_height) {
-    double scale = host->xwl->scale * host->contents_scale;
+    double scale = xwl_host_surface_scale(host) * host->contents_scale;
 
     if (host->viewport) {
       wp_viewport_set_destination(host->viewport,
@@ -1707,6 +2622,8 @@ static void xwl_host_surface_commit(struct wl_client *client,
   // No need to defer cursor or non-xwayland client commits.
   if (host->is_cursor || !host->xwl->xwayland) {
     wl_surface_commit(host->proxy);
+    if (!host->is_cursor && host->contents_width && host->contents_height)
+      xwl_startup_milestone(host->xwl, STARTUP_FIRST_FRAME);
   } else {
     // Commit if surface is associated with a window. Otherwise, defer
     // commit until window is created.
@@ -1714,8 +2631,10 @@ static void xwl_host_surface_commit(struct wl_client *client,
       if (window->host_surface_id == wl_resource_get_id(resource)) {
         if (window->xdg_surface) {
           wl_surface_commit(host->proxy);
-          if (host->contents_width && host->contents_height)
+          if (host->contents_width && host->contents_height) {
             window->realized = 1;
+            xwl_startup_milestone(host->xwl, STARTUP_FIRST_FRAME);
+          }
         }
         break;
       }
@@ -1793,6 +2712,8 @@ static void xwl_destroy_host_surface(struct wl_resource *resource) {
     buffer = wl_container_of(host->busy_buffers.next, buffer, link);
     xwl_output_buffer_destroy(buffer);
   }
+  wl_list_remove(&host->link);
+  wl_array_release(&host->entered_outputs);
 
   if (host->viewport)
     wp_viewport_destroy(host->viewport);
@@ -1847,6 +2768,78 @@ static void xwl_destroy_host_region(struct wl_resource *resource) {
   free(host);
 }
 
+// Removes |host_output| from the outputs that |host| is on. The most
+// recently entered of the remaining outputs decides the scale. Returns 1
+// if that changed the output.
+static int xwl_host_surface_remove_output(struct xwl_host_surface *host,
+                                          struct xwl_host_output *host_output) {
+  struct xwl_host_output **outputs = host->entered_outputs.data;
+  size_t count = host->entered_outputs.size / sizeof(*outputs);
+  size_t i;
+
+  for (i = 0; i < count; ++i) {
+    if (outputs[i] == host_output) {
+      memmove(&outputs[i], &outputs[i + 1],
+              (count - i - 1) * sizeof(*outputs));
+      host->entered_outputs.size -= sizeof(*outputs);
+      --count;
+      break;
+    }
+  }
+
+  if (host->output != host_output)
+    return 0;
+
+  host->output = count ? outputs[count - 1] : NULL;
+  return 1;
+}
+
+static void xwl_surface_enter(void *data, struct wl_surface *surface,
+                              struct wl_output *output) {
+  struct xwl_host_surface *host = wl_surface_get_user_data(surface);
+  struct xwl_host_output *host_output = wl_output_get_user_data(output);
+  struct xwl_host_output **entry;
+
+  if (!host_output)
+    return;
+
+  xwl_host_surface_remove_output(host, host_output);
+  entry = wl_array_add(&host->entered_outputs, sizeof(*entry));
+  assert(entry);
+  *entry = host_output;
+
+  // The most recently entered output decides the scale.
+  host->output = host_output;
+  xwl_update_window_scales(host->xwl);
+
+  // Each output binding gets its own event. Forward the one that belongs
+  // to the client of this surface.
+  if (wl_resource_get_client(host_output->resource) ==
+      wl_resource_get_client(host->resource)) {
+    wl_surface_send_enter(host->resource, host_output->resource);
+  }
+}
+
+static void xwl_surface_leave(void *data, struct wl_surface *surface,
+                              struct wl_output *output) {
+  struct xwl_host_surface *host = wl_surface_get_user_data(surface);
+  struct xwl_host_output *host_output = wl_output_get_user_data(output);
+
+  if (!host_output)
+    return;
+
+  if (xwl_host_surface_remove_output(host, host_output))
+    xwl_update_window_scales(host->xwl);
+
+  if (wl_resource_get_client(host_output->resource) ==
+      wl_resource_get_client(host->resource)) {
+    wl_surface_send_leave(host->resource, host_output->resource);
+  }
+}
+
+static const struct wl_surface_listener xwl_surface_listener = {
+    xwl_surface_enter, xwl_surface_leave};
+
 static void xwl_compositor_create_host_surface(struct wl_client *client,
                                                struct wl_resource *resource,
                                                uint32_t id) {
@@ -1867,6 +2860,11 @@ static void xwl_compositor_create_host_surface(struct wl_client *client,
   host_surface->current_buffer = NULL;
   wl_list_init(&host_surface->released_buffers);
   wl_list_init(&host_surface->busy_buffers);
+  host_surface->buffer_bytes = 0;
+  host_surface->last_commit_time = xwl_now_us();
+  host_surface->output = NULL;
+  wl_array_init(&host_surface->entered_outputs);
+  wl_list_insert(&host_surface->xwl->host_surfaces, &host_surface->link);
   host_surface->resource = wl_resource_create(
       client, &wl_surface_interface, wl_resource_get_version(resource), id);
   wl_resource_set_implementation(host_surface->resource,
@@ -1874,6 +2872,8 @@ static void xwl_compositor_create_host_surface(struct wl_client *client,
                                  xwl_destroy_host_surface);
   host_surface->proxy = wl_compositor_create_surface(host->proxy);
   wl_surface_set_user_data(host_surface->proxy, host_surface);
+  wl_surface_add_listener(host_surface->proxy, &xwl_surface_listener,
+                          host_surface);
   host_surface->viewport = NULL;
   if (host_surface->xwl->viewporter) {
     host_surface->viewport = wp_viewporter_get_viewport(
@@ -2340,24 +3340,19 @@ static void xwl_output_mode(void *data, struct wl_output *output,
   host->refresh = refresh;
 }
 
-static void xwl_output_done(void *data, struct wl_output *output) {
-  struct xwl_host_output *host = wl_output_get_user_data(output);
+static void xwl_send_host_output_state(struct xwl_host_output *host) {
   int scale_factor;
   double scale;
 
-  // Early out if current scale is expected but not yet know.
-  if (!host->current_scale)
-    return;
-
   // Always use 1 for scale factor and adjust geometry and mode based on max
   // scale factor for Xwayland client. Otherwise, pick an optimal scale factor
   // and adjust geometry and mode for it.
   if (host->output->xwl->xwayland) {
-    double current_scale = host->current_scale / 1000.0;
+    double current_scale = host->last_current_scale / 1000.0;
     int max_scale_factor = host->max_scale / 1000.0;
 
     scale_factor = 1;
-    scale = (host->output->xwl->scale * current_scale) / max_scale_factor;
+    scale = (xwl_host_output_scale(host) * current_scale) / max_scale_factor;
   } else {
     scale_factor = ceil(host->scale_factor / host->output->xwl->scale);
     scale = (host->output->xwl->scale * scale_factor) / host->scale_factor;
@@ -2371,6 +3366,36 @@ static void xwl_output_done(void *data, struct wl_output *output) {
                       host->width * scale, host->height * scale, host->refresh);
   wl_output_send_scale(host->resource, scale_factor);
   wl_output_send_done(host->resource);
+}
+
+static void xwl_output_done(void *data, struct wl_output *output) {
+  struct xwl_host_output *host = wl_output_get_user_data(output);
+  struct xwl *xwl = host->output->xwl;
+
+  // Early out if current scale is expected but not yet know.
+  if (!host->current_scale)
+    return;
+
+  host->last_current_scale = host->current_scale;
+
+  // Surfaces that have not entered an output yet use the scale of the
+  // densest output in native mode.
+  if (xwl->native_scale && xwl->xwayland && xwl->viewporter) {
+    struct xwl_host_output *other;
+    double scale = 0;
+
+    wl_list_for_each(other, &xwl->host_outputs, link) {
+      if (other->aura_output)
+        scale = MAX(scale, xwl_host_output_scale(other));
+    }
+    if (scale)
+      xwl->scale = scale;
+  }
+
+  xwl_send_host_output_state(host);
+
+  // Scale factors of all outputs affect the scale of each window.
+  xwl_update_window_scales(xwl);
 
   // Reset current scale.
   host->current_scale = 1000;
@@ -2424,9 +3449,16 @@ static const struct zaura_output_listener xwl_aura_output_listener = {
 
 static void xwl_destroy_host_output(struct wl_resource *resource) {
   struct xwl_host_output *host = wl_resource_get_user_data(resource);
+  struct xwl *xwl = host->output->xwl;
+  struct xwl_host_surface *host_surface;
+
+  wl_list_for_each(host_surface, &xwl->host_surfaces, link)
+    xwl_host_surface_remove_output(host_surface, host);
 
   if (host->aura_output)
     zaura_output_destroy(host->aura_output);
+  wl_list_remove(&host->link);
+  xwl_update_window_scales(xwl);
   if (wl_output_get_version(host->proxy) >= WL_OUTPUT_RELEASE_SINCE_VERSION) {
     wl_output_release(host->proxy);
   } else {
@@ -2471,7 +3503,9 @@ static void xwl_bind_host_output(struct wl_client *client, void *data,
   host->refresh = 60000;
   host->scale_factor = 1;
   host->current_scale = 1000;
+  host->last_current_scale = 1000;
   host->max_scale = 1000;
+  wl_list_insert(&xwl->host_outputs, &host->link);
   if (xwl->aura_shell &&
       (xwl->aura_shell->version >= ZAURA_SHELL_GET_AURA_OUTPUT_SINCE_VERSION)) {
     host->current_scale = 0;
@@ -2488,8 +3522,45 @@ static void xwl_internal_data_offer_destroy(struct xwl_data_offer *host) {
   free(host);
 }
 
+// Drops received selection data that no transfer needs anymore. Complete
+// data for the current offer is kept for later requests unless it is too
+// large to cache. Once trimmed, selection_data_base is non-zero and the
+// data can only be used by transfers that are already in progress.
+static void xwl_trim_selection_data(struct xwl *xwl) {
+  struct xwl_selection_transfer *transfer;
+  size_t offset = xwl->selection_data_base + xwl->selection_data.size;
+  size_t size;
+
+  if (xwl->selection_cache_offer && !xwl->selection_data_base &&
+      xwl->selection_data.size <= SELECTION_CACHE_MAX_SIZE)
+    return;
+
+  wl_list_for_each(transfer, &xwl->selection_transfers, link)
+    offset = MIN(offset, transfer->offset);
+
+  size = offset - xwl->selection_data_base;
+  if (!size)
+    return;
+
+  if (size == xwl->selection_data.size) {
+    wl_array_release(&xwl->selection_data);
+    wl_array_init(&xwl->selection_data);
+  } else {
+    memmove(xwl->selection_data.data, (char *)xwl->selection_data.data + size,
+            xwl->selection_data.size - size);
+    xwl->selection_data.size -= size;
+  }
+  xwl->selection_data_base += size;
+}
+
+static void xwl_invalidate_selection_cache(struct xwl *xwl) {
+  xwl->selection_cache_offer = NULL;
+  xwl_trim_selection_data(xwl);
+}
+
 static void xwl_set_selection(struct xwl *xwl,
                               struct xwl_data_offer *data_offer) {
+  xwl_invalidate_selection_cache(xwl);
 
   if (xwl->selection_data_offer) {
     xwl_internal_data_offer_destroy(xwl->selection_data_offer);
@@ -2510,17 +3581,61 @@ static void xwl_set_selection(struct xwl *xwl,
   }
 
   xwl->selection_data_offer = data_offer;
+
+  // Start receiving text in the background so that the first paste can be
+  // served from memory. Deferred to the next event loop iteration.
+  if (xwl->selection_prefetch_event_source && data_offer &&
+      (data_offer->mime_types & (1 << MIME_TYPE_UTF8_TEXT))) {
+    xwl->selection_prefetching = 0;
+    wl_event_source_timer_update(xwl->selection_prefetch_event_source, 1);
+  }
+}
+
+// Selection formats bridged between Wayland and X, as MIME type and the X
+// target it corresponds to. Data is passed through without conversion, so
+// only targets whose encoding matches the MIME type are listed. STRING is
+// Latin-1 and is left out in favour of UTF8_STRING.
+static const struct {
+  const char *mime_type;
+  int atom;
+} xwl_mime_types[] = {
+    {"text/plain;charset=utf-8", ATOM_UTF8_STRING},
+    {"text/html", ATOM_TEXT_HTML},
+    {"text/uri-list", ATOM_TEXT_URI_LIST},
+    {"image/png", ATOM_IMAGE_PNG},
+};
+
+static int xwl_lookup_mime_type(const char *mime_type) {
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(xwl_mime_types); ++i) {
+    if (strcmp(mime_type, xwl_mime_types[i].mime_type) == 0)
+      return i;
+  }
+  return -1;
 }
 
-static const char *xwl_utf8_mime_type = "text/plain;charset=utf-8";
+static int xwl_lookup_target_mime_type(struct xwl *xwl, xcb_atom_t target) {
+  int i;
+
+  if (target == xwl->atoms[ATOM_TEXT].value)
+    return MIME_TYPE_UTF8_TEXT;
+
+  for (i = 0; i < ARRAY_SIZE(xwl_mime_types); ++i) {
+    if (target == xwl->atoms[xwl_mime_types[i].atom].value)
+      return i;
+  }
+  return -1;
+}
 
 static void xwl_internal_data_offer_offer(void *data,
                                           struct wl_data_offer *data_offer,
                                           const char *type) {
   struct xwl_data_offer *host = data;
+  int mime_type = xwl_lookup_mime_type(type);
 
-  if (strcmp(type, xwl_utf8_mime_type) == 0)
-    host->utf8_text = 1;
+  if (mime_type >= 0)
+    host->mime_types |= 1 << mime_type;
 }
 
 static void xwl_internal_data_offer_source_actions(
@@ -2546,7 +3661,7 @@ xwl_internal_data_device_data_offer(void *data,
 
   host_data_offer->xwl = xwl;
   host_data_offer->internal = data_offer;
-  host_data_offer->utf8_text = 0;
+  host_data_offer->mime_types = 0;
 
   wl_data_offer_add_listener(host_data_offer->internal,
                              &xwl_internal_data_offer_listener,
@@ -2595,7 +3710,7 @@ static void xwl_host_pointer_set_cursor(struct wl_client *client,
                                         int32_t hotspot_x, int32_t hotspot_y) {
   struct xwl_host_pointer *host = wl_resource_get_user_data(resource);
   struct xwl_host_surface *host_surface = NULL;
-  double scale = host->seat->xwl->scale;
+  double scale = xwl_resource_scale(host->seat->xwl, surface_resource);
 
   if (surface_resource) {
     host_surface = wl_resource_get_user_data(surface_resource);
@@ -2625,6 +3740,102 @@ static void xwl_set_last_event_serial(struct wl_resource *surface_resource,
   host_surface->last_event_serial = serial;
 }
 
+static int xwl_pointer_has_pending_events(struct xwl_host_pointer *host) {
+  return host->has_pending_motion || host->has_pending_axis[0] ||
+         host->has_pending_axis[1];
+}
+
+// Sends motion and axis events held back by coalescing, followed by the
+// frame event that terminates them.
+static void xwl_pointer_flush(struct xwl_host_pointer *host) {
+  int i;
+
+  if (host->has_pending_motion) {
+    wl_pointer_send_motion(host->resource, host->pending_motion_time,
+                           host->pending_x, host->pending_y);
+    host->has_pending_motion = 0;
+  }
+  for (i = 0; i < ARRAY_SIZE(host->has_pending_axis); ++i) {
+    if (!host->has_pending_axis[i])
+      continue;
+
+    wl_pointer_send_axis(host->resource, host->pending_axis_time[i], i,
+                         host->pending_axis_value[i]);
+    host->has_pending_axis[i] = 0;
+  }
+  if (host->has_pending_frame) {
+    wl_pointer_send_frame(host->resource);
+    host->has_pending_frame = 0;
+  }
+
+  if (host->coalesce_event_source)
+    wl_event_source_timer_update(host->coalesce_event_source, 0);
+}
+
+// Sends pointer events held back for the client of |resource| so that they
+// arrive before other input events from |seat|.
+static void xwl_seat_flush_pointers(struct xwl_seat *seat,
+                                    struct wl_resource *resource) {
+  struct xwl_host_pointer *host;
+
+  wl_list_for_each(host, &seat->host_pointers, link) {
+    if (wl_resource_get_client(host->resource) ==
+        wl_resource_get_client(resource)) {
+      xwl_pointer_flush(host);
+    }
+  }
+}
+
+// Returns true if the client has not yet read all events sent to it.
+static int xwl_pointer_client_is_busy(struct xwl_host_pointer *host) {
+  int fd = wl_client_get_fd(wl_resource_get_client(host->resource));
+  int queued = 0;
+
+  if (ioctl(fd, TIOCOUTQ, &queued) == -1)
+    return 0;
+
+  return queued > 0;
+}
+
+static int xwl_pointer_handle_coalesce_timeout(void *data) {
+  struct xwl_host_pointer *host = data;
+
+  if (xwl_pointer_client_is_busy(host)) {
+    wl_event_source_timer_update(host->coalesce_event_source,
+                                 POINTER_COALESCE_INTERVAL_MS);
+  } else {
+    xwl_pointer_flush(host);
+  }
+  return 0;
+}
+
+// Returns true if a motion or axis event should be merged into the pending
+// events instead of being sent. Events are only merged while the client is
+// behind on reading and when frame events delimit them.
+static int xwl_pointer_coalesce(struct xwl_host_pointer *host) {
+  if (wl_resource_get_version(host->resource) <
+          WL_POINTER_FRAME_SINCE_VERSION ||
+      wl_pointer_get_version(host->proxy) < WL_POINTER_FRAME_SINCE_VERSION) {
+    return 0;
+  }
+
+  if (!xwl_pointer_client_is_busy(host))
+    return 0;
+
+  if (!host->coalesce_event_source) {
+    host->coalesce_event_source = wl_event_loop_add_timer(
+        wl_display_get_event_loop(host->seat->xwl->host_display),
+        xwl_pointer_handle_coalesce_timeout, host);
+  }
+
+  // Send held back events once the client catches up.
+  if (!xwl_pointer_has_pending_events(host) && !host->has_pending_frame) {
+    wl_event_source_timer_update(host->coalesce_event_source,
+                                 POINTER_COALESCE_INTERVAL_MS);
+  }
+  return 1;
+}
+
 static void xwl_pointer_set_focus(struct xwl_host_pointer *host,
                                   uint32_t serial,
                                   struct xwl_host_surface *host_surface,
@@ -2635,6 +3846,8 @@ static void xwl_pointer_set_focus(struct xwl_host_pointer *host,
   if (surface_resource == host->focus_resource)
     return;
 
+  xwl_pointer_flush(host);
+
   if (host->focus_resource)
     wl_pointer_send_leave(host->resource, serial, host->focus_resource);
 
@@ -2644,7 +3857,7 @@ static void xwl_pointer_set_focus(struct xwl_host_pointer *host,
   host->focus_serial = serial;
 
   if (surface_resource) {
-    double scale = host->seat->xwl->scale;
+    double scale = xwl_host_surface_scale(host_surface);
 
     if (host->seat->xwl->xwayland) {
       // Make sure focus surface is on top before sending enter event.
@@ -2688,8 +3901,17 @@ static void xwl_pointer_leave(void *data, struct wl_pointer *pointer,
 static void xwl_pointer_motion(void *data, struct wl_pointer *pointer,
                                uint32_t time, wl_fixed_t x, wl_fixed_t y) {
   struct xwl_host_pointer *host = wl_pointer_get_user_data(pointer);
-  double scale = host->seat->xwl->scale;
+  double scale = xwl_resource_scale(host->seat->xwl, host->focus_resource);
+
+  if (xwl_pointer_coalesce(host)) {
+    host->has_pending_motion = 1;
+    host->pending_motion_time = time;
+    host->pending_x = x * scale;
+    host->pending_y = y * scale;
+    return;
+  }
 
+  xwl_pointer_flush(host);
   wl_pointer_send_motion(host->resource, time, x * scale, y * scale);
 }
 
@@ -2698,6 +3920,7 @@ static void xwl_pointer_button(void *data, struct wl_pointer *pointer,
                                uint32_t state) {
   struct xwl_host_pointer *host = wl_pointer_get_user_data(pointer);
 
+  xwl_pointer_flush(host);
   wl_pointer_send_button(host->resource, serial, time, button, state);
 
   if (host->focus_resource)
@@ -2708,21 +3931,39 @@ static void xwl_pointer_button(void *data, struct wl_pointer *pointer,
 static void xwl_pointer_axis(void *data, struct wl_pointer *pointer,
                              uint32_t time, uint32_t axis, wl_fixed_t value) {
   struct xwl_host_pointer *host = wl_pointer_get_user_data(pointer);
-  double scale = host->seat->xwl->scale;
+  double scale = xwl_resource_scale(host->seat->xwl, host->focus_resource);
+
+  if (axis < ARRAY_SIZE(host->has_pending_axis) && xwl_pointer_coalesce(host)) {
+    if (!host->has_pending_axis[axis]) {
+      host->has_pending_axis[axis] = 1;
+      host->pending_axis_value[axis] = 0;
+    }
+    host->pending_axis_time[axis] = time;
+    host->pending_axis_value[axis] += value * scale;
+    return;
+  }
 
+  xwl_pointer_flush(host);
   wl_pointer_send_axis(host->resource, time, axis, value * scale);
 }
 
 static void xwl_pointer_frame(void *data, struct wl_pointer *pointer) {
   struct xwl_host_pointer *host = wl_pointer_get_user_data(pointer);
 
-  wl_pointer_send_frame(host->resource);
+  // Hold the frame back with the events it terminates so that the events
+  // of the next frame can be merged into it.
+  host->has_pending_frame = 1;
+  if (xwl_pointer_has_pending_events(host) && xwl_pointer_coalesce(host))
+    return;
+
+  xwl_pointer_flush(host);
 }
 
 void xwl_pointer_axis_source(void *data, struct wl_pointer *pointer,
                              uint32_t axis_source) {
   struct xwl_host_pointer *host = wl_pointer_get_user_data(pointer);
 
+  xwl_pointer_flush(host);
   wl_pointer_send_axis_source(host->resource, axis_source);
 }
 
@@ -2730,6 +3971,7 @@ static void xwl_pointer_axis_stop(void *data, struct wl_pointer *pointer,
                                   uint32_t time, uint32_t axis) {
   struct xwl_host_pointer *host = wl_pointer_get_user_data(pointer);
 
+  xwl_pointer_flush(host);
   wl_pointer_send_axis_stop(host->resource, time, axis);
 }
 
@@ -2737,6 +3979,7 @@ static void xwl_pointer_axis_discrete(void *data, struct wl_pointer *pointer,
                                       uint32_t axis, int32_t discrete) {
   struct xwl_host_pointer *host = wl_pointer_get_user_data(pointer);
 
+  xwl_pointer_flush(host);
   wl_pointer_send_axis_discrete(host->resource, axis, discrete);
 }
 
@@ -2753,34 +3996,163 @@ static void xwl_host_keyboard_release(struct wl_client *client,
 static const struct wl_keyboard_interface xwl_keyboard_implementation = {
     xwl_host_keyboard_release};
 
-static void xwl_keyboard_keymap(void *data, struct wl_keyboard *keyboard,
-                                uint32_t format, int32_t fd, uint32_t size) {
-  struct xwl_host_keyboard *host = wl_keyboard_get_user_data(keyboard);
+// 64-bit FNV-1a.
+static uint64_t xwl_hash(const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  uint64_t hash = 0xcbf29ce484222325ull;
 
-  wl_keyboard_send_keymap(host->resource, format, fd, size);
+  while (size--) {
+    hash ^= *bytes++;
+    hash *= 0x100000001b3ull;
+  }
 
-  if (format == WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1) {
-    void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  return hash;
+}
 
-    assert(data != MAP_FAILED);
+// Returns the cached keymap for |text| or NULL if it has not been compiled.
+static struct xwl_keymap *xwl_keymap_lookup(struct xwl *xwl, const char *text,
+                                            size_t size) {
+  uint64_t hash = xwl_hash(text, size);
+  struct xwl_keymap *keymap;
 
-    if (host->keymap)
-      xkb_keymap_unref(host->keymap);
+  wl_list_for_each(keymap, &xwl->keymaps, link) {
+    if (keymap->hash == hash && keymap->size == size &&
+        memcmp(keymap->text, text, size) == 0) {
+      // Most recently used first.
+      wl_list_remove(&keymap->link);
+      wl_list_insert(&xwl->keymaps, &keymap->link);
+      return keymap;
+    }
+  }
 
-    host->keymap = xkb_keymap_new_from_string(
-        host->seat->xwl->xkb_context, data, XKB_KEYMAP_FORMAT_TEXT_V1, 0);
-    assert(host->keymap);
+  return NULL;
+}
+
+static void xwl_keymap_destroy(struct xwl_keymap *keymap) {
+  wl_list_remove(&keymap->link);
+  xkb_keymap_unref(keymap->keymap);
+  free(keymap->text);
+  free(keymap);
+}
+
+// Compiles |text| and adds the result to the cache. Keyboards hold their
+// own reference, so evicted keymaps stay valid for existing users.
+static struct xwl_keymap *xwl_keymap_compile(struct xwl *xwl,
+                                             const char *text, size_t size) {
+  struct xwl_keymap *keymap;
+
+  keymap = malloc(sizeof(*keymap));
+  assert(keymap);
+
+  // Make sure the text is null-terminated.
+  keymap->text = malloc(size + 1);
+  assert(keymap->text);
+  memcpy(keymap->text, text, size);
+  keymap->text[size] = '\0';
+
+  keymap->keymap = xkb_keymap_new_from_string(
+      xwl->xkb_context, keymap->text, XKB_KEYMAP_FORMAT_TEXT_V1, 0);
+  if (!keymap->keymap) {
+    free(keymap->text);
+    free(keymap);
+    return NULL;
+  }
+
+  keymap->hash = xwl_hash(text, size);
+  keymap->size = size;
+  keymap->control_mask =
+      1 << xkb_keymap_mod_get_index(keymap->keymap, "Control");
+  keymap->alt_mask = 1 << xkb_keymap_mod_get_index(keymap->keymap, "Mod1");
+  keymap->shift_mask = 1 << xkb_keymap_mod_get_index(keymap->keymap, "Shift");
+  wl_list_insert(&xwl->keymaps, &keymap->link);
+
+  if (wl_list_length(&xwl->keymaps) > MAX_KEYMAP_CACHE_SIZE)
+    xwl_keymap_destroy(wl_container_of(xwl->keymaps.prev, keymap, link));
+
+  return keymap;
+}
+
+// Saves |keymap| so that pre-started workers can compile it before they
+// are handed a client.
+static void xwl_keymap_cache_store(struct xwl *xwl,
+                                   struct xwl_keymap *keymap) {
+  char tmp_path[PATH_MAX];
+  ssize_t bytes;
+  int fd;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", xwl->keymap_cache, getpid());
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return;
+
+  bytes = write(fd, keymap->text, keymap->size);
+  close(fd);
+
+  // Replace the old file atomically.
+  if (bytes != (ssize_t)keymap->size || rename(tmp_path, xwl->keymap_cache))
+    unlink(tmp_path);
+}
+
+static void xwl_keymap_cache_load(struct xwl *xwl) {
+  struct stat st;
+  void *data;
+  int fd;
+
+  fd = open(xwl->keymap_cache, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data != MAP_FAILED) {
+      if (!xwl_keymap_lookup(xwl, data, st.st_size))
+        xwl_keymap_compile(xwl, data, st.st_size);
+      munmap(data, st.st_size);
+    }
+  }
+
+  close(fd);
+}
+
+static void xwl_keyboard_keymap(void *data, struct wl_keyboard *keyboard,
+                                uint32_t format, int32_t fd, uint32_t size) {
+  struct xwl_host_keyboard *host = wl_keyboard_get_user_data(keyboard);
+
+  // Input is delivered in order, so held pointer events go first.
+  xwl_seat_flush_pointers(host->seat, host->resource);
+
+  wl_keyboard_send_keymap(host->resource, format, fd, size);
+
+  if (format == WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1) {
+    struct xwl *xwl = host->seat->xwl;
+    struct xwl_keymap *keymap;
+    void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    assert(data != MAP_FAILED);
+
+    // Keymaps are usually identical across keyboards and rebinds.
+    keymap = xwl_keymap_lookup(xwl, data, size);
+    if (!keymap) {
+      keymap = xwl_keymap_compile(xwl, data, size);
+      assert(keymap);
+      if (xwl->keymap_cache)
+        xwl_keymap_cache_store(xwl, keymap);
+    }
 
     munmap(data, size);
 
+    if (host->keymap)
+      xkb_keymap_unref(host->keymap);
+    host->keymap = xkb_keymap_ref(keymap->keymap);
+
     if (host->state)
       xkb_state_unref(host->state);
     host->state = xkb_state_new(host->keymap);
     assert(host->state);
 
-    host->control_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Control");
-    host->alt_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Mod1");
-    host->shift_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Shift");
+    host->control_mask = keymap->control_mask;
+    host->alt_mask = keymap->alt_mask;
+    host->shift_mask = keymap->shift_mask;
   }
 
   close(fd);
@@ -2820,6 +4192,9 @@ static void xwl_keyboard_enter(void *data, struct wl_keyboard *keyboard,
   struct xwl_host_surface *host_surface =
       surface ? wl_surface_get_user_data(surface) : NULL;
 
+  // Input is delivered in order, so held pointer events go first.
+  xwl_seat_flush_pointers(host->seat, host->resource);
+
   if (!host_surface)
     return;
 
@@ -2832,6 +4207,9 @@ static void xwl_keyboard_leave(void *data, struct wl_keyboard *keyboard,
                                uint32_t serial, struct wl_surface *surface) {
   struct xwl_host_keyboard *host = wl_keyboard_get_user_data(keyboard);
 
+  // Input is delivered in order, so held pointer events go first.
+  xwl_seat_flush_pointers(host->seat, host->resource);
+
   xwl_keyboard_set_focus(host, serial, NULL, NULL);
 }
 
@@ -2840,6 +4218,9 @@ static void xwl_keyboard_key(void *data, struct wl_keyboard *keyboard,
                              uint32_t state) {
   struct xwl_host_keyboard *host = wl_keyboard_get_user_data(keyboard);
 
+  // Input is delivered in order, so held pointer events go first.
+  xwl_seat_flush_pointers(host->seat, host->resource);
+
   if (host->state) {
     const xkb_keysym_t *symbols;
     uint32_t num_symbols;
@@ -2885,6 +4266,9 @@ static void xwl_keyboard_modifiers(void *data, struct wl_keyboard *keyboard,
   struct xwl_host_keyboard *host = wl_keyboard_get_user_data(keyboard);
   xkb_mod_mask_t mask;
 
+  // Input is delivered in order, so held pointer events go first.
+  xwl_seat_flush_pointers(host->seat, host->resource);
+
   wl_keyboard_send_modifiers(host->resource, serial, mods_depressed,
                              mods_latched, mods_locked, group);
 
@@ -2912,6 +4296,9 @@ static void xwl_keyboard_repeat_info(void *data, struct wl_keyboard *keyboard,
                                      int32_t rate, int32_t delay) {
   struct xwl_host_keyboard *host = wl_keyboard_get_user_data(keyboard);
 
+  // Input is delivered in order, so held pointer events go first.
+  xwl_seat_flush_pointers(host->seat, host->resource);
+
   wl_keyboard_send_repeat_info(host->resource, rate, delay);
 }
 
@@ -2934,11 +4321,13 @@ static void xwl_host_touch_down(void *data, struct wl_touch *touch,
   struct xwl_host_touch *host = wl_touch_get_user_data(touch);
   struct xwl_host_surface *host_surface =
       surface ? wl_surface_get_user_data(surface) : NULL;
-  double scale = host->seat->xwl->scale;
+  double scale;
 
   if (!host_surface)
     return;
 
+  scale = xwl_host_surface_scale(host_surface);
+
   if (host_surface->resource != host->focus_resource) {
     wl_list_remove(&host->focus_resource_listener.link);
     wl_list_init(&host->focus_resource_listener.link);
@@ -2981,7 +4370,7 @@ static void xwl_host_touch_motion(void *data, struct wl_touch *touch,
                                   uint32_t time, int32_t id, wl_fixed_t x,
                                   wl_fixed_t y) {
   struct xwl_host_touch *host = wl_touch_get_user_data(touch);
-  double scale = host->seat->xwl->scale;
+  double scale = xwl_resource_scale(host->seat->xwl, host->focus_resource);
 
   wl_touch_send_motion(host->resource, time, id, x * scale, y * scale);
 }
@@ -3010,7 +4399,10 @@ static void xwl_destroy_host_pointer(struct wl_resource *resource) {
   } else {
     wl_pointer_destroy(host->proxy);
   }
+  if (host->coalesce_event_source)
+    wl_event_source_remove(host->coalesce_event_source);
   wl_list_remove(&host->focus_resource_listener.link);
+  wl_list_remove(&host->link);
   wl_resource_set_user_data(resource, NULL);
   free(host);
 }
@@ -3033,6 +4425,7 @@ static void xwl_host_seat_get_host_pointer(struct wl_client *client,
   assert(host_pointer);
 
   host_pointer->seat = host->seat;
+  wl_list_insert(&host->seat->host_pointers, &host_pointer->link);
   host_pointer->resource = wl_resource_create(
       client, &wl_pointer_interface, wl_resource_get_version(resource), id);
   wl_resource_set_implementation(host_pointer->resource,
@@ -3047,6 +4440,11 @@ static void xwl_host_seat_get_host_pointer(struct wl_client *client,
       xwl_pointer_focus_resource_destroyed;
   host_pointer->focus_resource = NULL;
   host_pointer->focus_serial = 0;
+  host_pointer->coalesce_event_source = NULL;
+  host_pointer->has_pending_motion = 0;
+  host_pointer->has_pending_axis[0] = 0;
+  host_pointer->has_pending_axis[1] = 0;
+  host_pointer->has_pending_frame = 0;
 }
 
 static void xwl_destroy_host_keyboard(struct wl_resource *resource) {
@@ -3675,6 +5073,7 @@ static void xwl_xdg_surface_get_toplevel(struct wl_client *client,
   zxdg_toplevel_v6_set_user_data(host_xdg_toplevel->proxy, host_xdg_toplevel);
   zxdg_toplevel_v6_add_listener(host_xdg_toplevel->proxy,
                                 &xwl_xdg_toplevel_listener, host_xdg_toplevel);
+  xwl_startup_milestone(host->xwl, STARTUP_FIRST_WINDOW_MAPPED);
 }
 
 static void xwl_xdg_surface_get_popup(struct wl_client *client,
@@ -3881,8 +5280,7 @@ static void xwl_data_offer_receive(struct wl_client *client,
       return;
     }
 
-    xwl_data_transfer_create(wl_display_get_event_loop(host->xwl->host_display),
-                             new_pipe.fd, fd);
+    xwl_data_transfer_create(host->xwl, new_pipe.fd, fd);
 
     wl_data_offer_receive(host->proxy, mime_type, new_pipe.fd);
   } break;
@@ -4576,6 +5974,7 @@ static void xwl_registry_handler(void *data, struct wl_registry *registry,
     seat->host_global = xwl_global_create(
         xwl, &wl_seat_interface, seat->version, seat, xwl_bind_host_seat);
     seat->last_serial = 0;
+    wl_list_init(&seat->host_pointers);
     wl_list_insert(&xwl->seats, &seat->link);
   } else if (strcmp(interface, "wl_data_device_manager") == 0) {
     struct xwl_data_device_manager *data_device_manager =
@@ -4758,6 +6157,12 @@ static void xwl_registry_remover(void *data, struct wl_registry *registry,
   }
   wl_list_for_each(seat, &xwl->seats, link) {
     if (seat->id == id) {
+      struct xwl_host_pointer *host_pointer, *next;
+
+      wl_list_for_each_safe(host_pointer, next, &seat->host_pointers, link) {
+        wl_list_remove(&host_pointer->link);
+        wl_list_init(&host_pointer->link);
+      }
       xwl_global_destroy(seat->host_global);
       wl_list_remove(&seat->link);
       free(seat);
@@ -4777,7 +6182,7 @@ static int xwl_handle_event(int fd, uint32_t mask, void *data) {
   int count = 0;
 
   if ((mask & WL_EVENT_HANGUP) || (mask & WL_EVENT_ERROR)) {
-    wl_client_flush(xwl->client);
+    wl_display_flush_clients(xwl->host_display);
     exit(EXIT_SUCCESS);
   }
 
@@ -4809,6 +6214,7 @@ static void xwl_create_window(struct xwl *xwl, xcb_window_t id, int x, int y,
   window->width = width;
   window->height = height;
   window->border_width = border_width;
+  window->scale = xwl->scale;
   window->depth = 0;
   window->managed = 0;
   window->realized = 0;
@@ -4820,7 +6226,9 @@ static void xwl_create_window(struct xwl *xwl, xcb_window_t id, int x, int y,
   window->name = NULL;
   window->clazz = NULL;
   window->startup_id = NULL;
+  window->has_net_wm_name = 0;
   window->size_flags = P_POSITION;
+  window->dirty_properties = 0;
   window->xdg_surface = NULL;
   window->xdg_toplevel = NULL;
   window->xdg_popup = NULL;
@@ -4831,6 +6239,13 @@ static void xwl_create_window(struct xwl *xwl, xcb_window_t id, int x, int y,
   window->pending_config.serial = 0;
   window->pending_config.mask = 0;
   window->pending_config.states_length = 0;
+  window->frame_callback = NULL;
+  window->frame_timeout_event_source = NULL;
+  if (xwl->configure_pacing) {
+    window->frame_timeout_event_source = wl_event_loop_add_timer(
+        wl_display_get_event_loop(xwl->host_display),
+        xwl_window_handle_frame_timeout, window);
+  }
   wl_list_insert(&xwl->unpaired_windows, &window->link);
   values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_FOCUS_CHANGE;
   xcb_change_window_attributes(xwl->connection, window->id, XCB_CW_EVENT_MASK,
@@ -4847,6 +6262,10 @@ static void xwl_destroy_window(struct xwl_window *window) {
     window->xwl->needs_set_input_focus = 1;
   }
 
+  xwl_window_cancel_frame(window);
+  if (window->frame_timeout_event_source)
+    wl_event_source_remove(window->frame_timeout_event_source);
+
   if (window->xdg_popup)
     zxdg_popup_v6_destroy(window->xdg_popup);
   if (window->xdg_toplevel)
@@ -4863,6 +6282,8 @@ static void xwl_destroy_window(struct xwl_window *window) {
   if (window->startup_id)
     free(window->startup_id);
 
+  if (window->dirty_properties)
+    wl_list_remove(&window->dirty_link);
   wl_list_remove(&window->link);
   free(window);
 }
@@ -4904,6 +6325,10 @@ static void xwl_handle_create_notify(struct xwl *xwl,
   if (xwl_is_our_window(xwl, event->window))
     return;
 
+  // Windows created while connecting may already have been adopted.
+  if (xwl_lookup_window(xwl, event->window))
+    return;
+
   xwl_create_window(xwl, event->window, event->x, event->y, event->width,
                     event->height, event->border_width);
 }
@@ -4955,44 +6380,263 @@ static void xwl_handle_reparent_notify(struct xwl *xwl,
   xwl_destroy_window(window);
 }
 
+static xcb_atom_t xwl_property_atom(struct xwl *xwl, int type) {
+  switch (type) {
+  case PROPERTY_NET_WM_NAME:
+    return xwl->atoms[ATOM_NET_WM_NAME].value;
+  case PROPERTY_WM_NAME:
+    return XCB_ATOM_WM_NAME;
+  case PROPERTY_WM_CLASS:
+    return XCB_ATOM_WM_CLASS;
+  case PROPERTY_WM_TRANSIENT_FOR:
+    return XCB_ATOM_WM_TRANSIENT_FOR;
+  case PROPERTY_WM_NORMAL_HINTS:
+    return XCB_ATOM_WM_NORMAL_HINTS;
+  case PROPERTY_WM_CLIENT_LEADER:
+    return xwl->atoms[ATOM_WM_CLIENT_LEADER].value;
+  case PROPERTY_MOTIF_WM_HINTS:
+    return xwl->atoms[ATOM_MOTIF_WM_HINTS].value;
+  case PROPERTY_NET_STARTUP_ID:
+    return xwl->atoms[ATOM_NET_STARTUP_ID].value;
+  }
+  return XCB_ATOM_NONE;
+}
+
+// Updates the state of |window| that is tracked for property |type|. A NULL
+// |reply| or a reply of type None means that the property is not set.
+// WM_NORMAL_HINTS are copied to |size_hints|.
+static void xwl_window_read_property(struct xwl_window *window, int type,
+                                     xcb_get_property_reply_t *reply,
+                                     struct xwl_wm_size_hints *size_hints) {
+  const char *value = NULL;
+  int value_length = 0;
+
+  if (reply && reply->type != XCB_ATOM_NONE) {
+    value = xcb_get_property_value(reply);
+    value_length = xcb_get_property_value_length(reply);
+  }
+
+  switch (type) {
+  case PROPERTY_NET_WM_NAME:
+    // Keep the WM_NAME title unless _NET_WM_NAME is or was set.
+    if (!value && !window->has_net_wm_name)
+      break;
+    if (window->name) {
+      free(window->name);
+      window->name = NULL;
+    }
+    if (value)
+      window->name = strndup(value, value_length);
+    window->has_net_wm_name = !!value;
+    break;
+  case PROPERTY_WM_NAME:
+    if (window->has_net_wm_name)
+      break;
+    if (window->name) {
+      free(window->name);
+      window->name = NULL;
+    }
+    if (value)
+      window->name = strndup(value, value_length);
+    break;
+  case PROPERTY_WM_CLASS:
+    if (window->clazz) {
+      free(window->clazz);
+      window->clazz = NULL;
+    }
+    if (value) {
+      // WM_CLASS property contains two consecutive null-terminated strings.
+      // These specify the Instance and Class names. If a global app ID is
+      // not set then use Class name for app ID.
+      int instance_length = strnlen(value, value_length);
+      if (value_length > instance_length) {
+        window->clazz = strndup(value + instance_length + 1,
+                                value_length - instance_length - 1);
+      }
+    }
+    break;
+  case PROPERTY_WM_TRANSIENT_FOR:
+    window->transient_for = XCB_WINDOW_NONE;
+    if (value_length >= 4)
+      window->transient_for = *((uint32_t *)value);
+    break;
+  case PROPERTY_WM_NORMAL_HINTS:
+    if (value_length >= sizeof(*size_hints))
+      memcpy(size_hints, value, sizeof(*size_hints));
+    break;
+  case PROPERTY_WM_CLIENT_LEADER:
+    window->client_leader = XCB_WINDOW_NONE;
+    if (value_length >= 4)
+      window->client_leader = *((uint32_t *)value);
+    break;
+  case PROPERTY_MOTIF_WM_HINTS: {
+    struct xwl_mwm_hints mwm_hints = {0};
+
+    if (value_length >= sizeof(mwm_hints))
+      memcpy(&mwm_hints, value, sizeof(mwm_hints));
+
+    window->decorated = 1;
+    if (mwm_hints.flags & MWM_HINTS_DECORATIONS) {
+      if (mwm_hints.decorations & MWM_DECOR_ALL)
+        window->decorated = ~mwm_hints.decorations & MWM_DECOR_TITLE;
+      else
+        window->decorated = mwm_hints.decorations & MWM_DECOR_TITLE;
+    }
+  } break;
+  case PROPERTY_NET_STARTUP_ID:
+    if (window->startup_id) {
+      free(window->startup_id);
+      window->startup_id = NULL;
+    }
+    if (value)
+      window->startup_id = strndup(value, value_length);
+    break;
+  default:
+    break;
+  }
+}
+
+static void xwl_window_set_frame_extents(struct xwl_window *window) {
+  struct xwl *xwl = window->xwl;
+  uint32_t values[4];
+
+  values[0] = 0;
+  values[1] = 0;
+  values[2] = window->decorated ? CAPTION_HEIGHT * xwl->scale : 0;
+  values[3] = 0;
+  xcb_change_property(xwl->connection, XCB_PROP_MODE_REPLACE, window->id,
+                      xwl->atoms[ATOM_NET_FRAME_EXTENTS].value,
+                      XCB_ATOM_CARDINAL, 32, 4, values);
+}
+
+static void xwl_window_set_property_dirty(struct xwl_window *window,
+                                          int type) {
+  uint32_t mask = 1 << type;
+
+  // WM_NAME is used as title when _NET_WM_NAME is removed and the position
+  // flags of transients depend on WM_NORMAL_HINTS.
+  if (type == PROPERTY_NET_WM_NAME)
+    mask |= 1 << PROPERTY_WM_NAME;
+  if (type == PROPERTY_WM_TRANSIENT_FOR)
+    mask |= 1 << PROPERTY_WM_NORMAL_HINTS;
+
+  if (!window->dirty_properties)
+    wl_list_insert(window->xwl->dirty_windows.prev, &window->dirty_link);
+  window->dirty_properties |= mask;
+}
+
+// Forwards property changes of a mapped window to the host.
+static void xwl_window_apply_properties(struct xwl_window *window,
+                                        uint32_t changed,
+                                        struct xwl_wm_size_hints *size_hints) {
+  struct xwl *xwl = window->xwl;
+
+  if (window->managed) {
+    if (changed & (1 << PROPERTY_WM_NORMAL_HINTS)) {
+      // Allow user/program controlled position for transients.
+      window->size_flags = 0;
+      if (window->transient_for)
+        window->size_flags |= size_hints->flags & (US_POSITION | P_POSITION);
+    }
+
+    if (changed & (1 << PROPERTY_MOTIF_WM_HINTS)) {
+      xwl_window_set_frame_extents(window);
+      if (window->aura_surface) {
+        zaura_surface_set_frame(window->aura_surface,
+                                xwl_window_frame_type(window));
+      }
+    }
+  }
+
+  if (window->xdg_toplevel) {
+    if ((changed & (1 << PROPERTY_WM_NAME)) && xwl->show_window_title) {
+      zxdg_toplevel_v6_set_title(window->xdg_toplevel,
+                                 window->name ? window->name : "");
+    }
+
+    if (window->managed) {
+      if ((changed & (1 << PROPERTY_WM_CLASS)) && !xwl->app_id &&
+          window->clazz) {
+        zxdg_toplevel_v6_set_app_id(window->xdg_toplevel, window->clazz);
+      }
+
+      if (changed & (1 << PROPERTY_WM_TRANSIENT_FOR)) {
+        struct xwl_window *parent = xwl_window_transient_parent(window);
+
+        zxdg_toplevel_v6_set_parent(window->xdg_toplevel,
+                                    parent ? parent->xdg_toplevel : NULL);
+      }
+    }
+  }
+
+  if ((changed & (1 << PROPERTY_NET_STARTUP_ID)) && window->aura_surface &&
+      xwl->aura_shell->version >= ZAURA_SURFACE_SET_STARTUP_ID_SINCE_VERSION) {
+    zaura_surface_set_startup_id(window->aura_surface, window->startup_id);
+  }
+}
+
+// Fetches all window properties that have changed since the last call using
+// one batch of pipelined requests. Returns the number of windows updated.
+static int xwl_update_dirty_window_properties(struct xwl *xwl) {
+  struct xwl_window *window, *next;
+  xcb_get_property_cookie_t *cookie;
+  struct wl_array cookies;
+  int count = 0;
+  int i;
+
+  if (wl_list_empty(&xwl->dirty_windows))
+    return 0;
+
+  wl_array_init(&cookies);
+  wl_list_for_each(window, &xwl->dirty_windows, dirty_link) {
+    for (i = 0; i <= PROPERTY_LAST; ++i) {
+      if (!(window->dirty_properties & (1 << i)))
+        continue;
+
+      cookie = wl_array_add(&cookies, sizeof(*cookie));
+      assert(cookie);
+      *cookie = xcb_get_property(xwl->connection, 0, window->id,
+                                 xwl_property_atom(xwl, i), XCB_ATOM_ANY, 0,
+                                 2048);
+    }
+  }
+
+  cookie = cookies.data;
+  wl_list_for_each_safe(window, next, &xwl->dirty_windows, dirty_link) {
+    struct xwl_wm_size_hints size_hints = {0};
+    uint32_t changed = window->dirty_properties;
+
+    for (i = 0; i <= PROPERTY_LAST; ++i) {
+      xcb_get_property_reply_t *reply;
+
+      if (!(changed & (1 << i)))
+        continue;
+
+      reply = xcb_get_property_reply(xwl->connection, *cookie++, NULL);
+      xwl_window_read_property(window, i, reply, &size_hints);
+      free(reply);
+    }
+
+    // A title from _NET_WM_NAME is applied the same way as WM_NAME.
+    if (changed & (1 << PROPERTY_NET_WM_NAME))
+      changed |= 1 << PROPERTY_WM_NAME;
+
+    window->dirty_properties = 0;
+    wl_list_remove(&window->dirty_link);
+    xwl_window_apply_properties(window, changed, &size_hints);
+    ++count;
+  }
+  wl_array_release(&cookies);
+
+  return count;
+}
+
 static void xwl_handle_map_request(struct xwl *xwl,
                                    xcb_map_request_event_t *event) {
   struct xwl_window *window = xwl_lookup_window(xwl, event->window);
-  struct {
-    int type;
-    xcb_atom_t atom;
-  } properties[] = {
-      {PROPERTY_WM_NAME, XCB_ATOM_WM_NAME},
-      {PROPERTY_WM_CLASS, XCB_ATOM_WM_CLASS},
-      {PROPERTY_WM_TRANSIENT_FOR, XCB_ATOM_WM_TRANSIENT_FOR},
-      {PROPERTY_WM_NORMAL_HINTS, XCB_ATOM_WM_NORMAL_HINTS},
-      {PROPERTY_WM_CLIENT_LEADER, xwl->atoms[ATOM_WM_CLIENT_LEADER].value},
-      {PROPERTY_MOTIF_WM_HINTS, xwl->atoms[ATOM_MOTIF_WM_HINTS].value},
-      {PROPERTY_NET_STARTUP_ID, xwl->atoms[ATOM_NET_STARTUP_ID].value},
-  };
   xcb_get_geometry_cookie_t geometry_cookie;
-  xcb_get_property_cookie_t property_cookies[ARRAY_SIZE(properties)];
-  struct xwl_wm_size_hints {
-    uint32_t flags;
-    int32_t x, y;
-    int32_t width, height;
-    int32_t min_width, min_height;
-    int32_t max_width, max_height;
-    int32_t width_inc, height_inc;
-    struct {
-      int32_t x;
-      int32_t y;
-    } min_aspect, max_aspect;
-    int32_t base_width, base_height;
-    int32_t win_gravity;
-  } size_hints = {0};
-  struct xwl_mwm_hints {
-    uint32_t flags;
-    uint32_t functions;
-    uint32_t decorations;
-    int32_t input_mode;
-    uint32_t status;
-  } mwm_hints = {0};
+  xcb_get_property_cookie_t property_cookies[PROPERTY_LAST + 1];
+  struct xwl_wm_size_hints size_hints = {0};
   uint32_t values[5];
   int i;
 
@@ -5005,10 +6649,10 @@ static void xwl_handle_map_request(struct xwl *xwl,
   if (window->frame_id == XCB_WINDOW_NONE)
     geometry_cookie = xcb_get_geometry(xwl->connection, window->id);
 
-  for (i = 0; i < ARRAY_SIZE(properties); ++i) {
+  for (i = 0; i <= PROPERTY_LAST; ++i) {
     property_cookies[i] =
-        xcb_get_property(xwl->connection, 0, window->id, properties[i].atom,
-                         XCB_ATOM_ANY, 0, 2048);
+        xcb_get_property(xwl->connection, 0, window->id,
+                         xwl_property_atom(xwl, i), XCB_ATOM_ANY, 0, 2048);
   }
 
   if (window->frame_id == XCB_WINDOW_NONE) {
@@ -5024,86 +6668,22 @@ static void xwl_handle_map_request(struct xwl *xwl,
     }
   }
 
-  if (window->name) {
-    free(window->name);
-    window->name = NULL;
-  }
-  if (window->clazz) {
-    free(window->clazz);
-    window->clazz = NULL;
+  // All properties are read below so pending updates are no longer needed.
+  if (window->dirty_properties) {
+    window->dirty_properties = 0;
+    wl_list_remove(&window->dirty_link);
   }
-  if (window->startup_id) {
-    free(window->startup_id);
-    window->startup_id = NULL;
-  }
-  window->transient_for = XCB_WINDOW_NONE;
-  window->client_leader = XCB_WINDOW_NONE;
-  window->decorated = 1;
-  window->size_flags = 0;
 
-  for (i = 0; i < ARRAY_SIZE(properties); ++i) {
+  for (i = 0; i <= PROPERTY_LAST; ++i) {
     xcb_get_property_reply_t *reply =
         xcb_get_property_reply(xwl->connection, property_cookies[i], NULL);
 
-    if (!reply)
-      continue;
-
-    if (reply->type == XCB_ATOM_NONE) {
-      free(reply);
-      continue;
-    }
-
-    switch (properties[i].type) {
-    case PROPERTY_WM_NAME:
-      window->name = strndup(xcb_get_property_value(reply),
-                             xcb_get_property_value_length(reply));
-      break;
-    case PROPERTY_WM_CLASS: {
-      // WM_CLASS property contains two consecutive null-terminated strings.
-      // These specify the Instance and Class names. If a global app ID is
-      // not set then use Class name for app ID.
-      const char *value = xcb_get_property_value(reply);
-      int value_length = xcb_get_property_value_length(reply);
-      int instance_length = strnlen(value, value_length);
-      if (value_length > instance_length) {
-        window->clazz = strndup(value + instance_length + 1,
-                                value_length - instance_length - 1);
-      }
-    } break;
-    case PROPERTY_WM_TRANSIENT_FOR:
-      if (xcb_get_property_value_length(reply) >= 4)
-        window->transient_for = *((uint32_t *)xcb_get_property_value(reply));
-      break;
-    case PROPERTY_WM_NORMAL_HINTS:
-      if (xcb_get_property_value_length(reply) >= sizeof(size_hints))
-        memcpy(&size_hints, xcb_get_property_value(reply), sizeof(size_hints));
-      break;
-    case PROPERTY_WM_CLIENT_LEADER:
-      if (xcb_get_property_value_length(reply) >= 4)
-        window->client_leader = *((uint32_t *)xcb_get_property_value(reply));
-      break;
-    case PROPERTY_MOTIF_WM_HINTS:
-      if (xcb_get_property_value_length(reply) >= sizeof(mwm_hints))
-        memcpy(&mwm_hints, xcb_get_property_value(reply), sizeof(mwm_hints));
-      break;
-    case PROPERTY_NET_STARTUP_ID:
-      window->startup_id = strndup(xcb_get_property_value(reply),
-                                   xcb_get_property_value_length(reply));
-      break;
-    default:
-      break;
-    }
+    xwl_window_read_property(window, i, reply, &size_hints);
     free(reply);
   }
 
-  if (mwm_hints.flags & MWM_HINTS_DECORATIONS) {
-    if (mwm_hints.decorations & MWM_DECOR_ALL)
-      window->decorated = ~mwm_hints.decorations & MWM_DECOR_TITLE;
-    else
-      window->decorated = mwm_hints.decorations & MWM_DECOR_TITLE;
-  }
-
   // Allow user/program controlled position for transients.
+  window->size_flags = 0;
   if (window->transient_for)
     window->size_flags |= size_hints.flags & (US_POSITION | P_POSITION);
 
@@ -5144,13 +6724,7 @@ static void xwl_handle_map_request(struct xwl *xwl,
                        XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT |
                            XCB_CONFIG_WINDOW_BORDER_WIDTH,
                        values);
-  values[0] = 0;
-  values[1] = 0;
-  values[2] = window->decorated ? CAPTION_HEIGHT * xwl->scale : 0;
-  values[3] = 0;
-  xcb_change_property(xwl->connection, XCB_PROP_MODE_REPLACE, window->id,
-                      xwl->atoms[ATOM_NET_FRAME_EXTENTS].value,
-                      XCB_ATOM_CARDINAL, 32, 4, values);
+  xwl_window_set_frame_extents(window);
 
   if (window->frame_id == XCB_WINDOW_NONE) {
     int depth = window->depth ? window->depth : xwl->screen->root_depth;
@@ -5207,6 +6781,11 @@ static void xwl_handle_unmap_notify(struct xwl *xwl,
   if (!window)
     return;
 
+  // Reparenting a window that was mapped before it was adopted unmaps it
+  // from the root window. It is mapped again in its frame.
+  if (event->event == xwl->screen->root && window->frame_id != XCB_WINDOW_NONE)
+    return;
+
   if (xwl->host_focus_window == window) {
     xwl->host_focus_window = NULL;
     xwl->needs_set_input_focus = 1;
@@ -5482,33 +7061,78 @@ static void xwl_handle_focus_in(struct xwl *xwl, xcb_focus_in_event_t *event) {}
 static void xwl_handle_focus_out(struct xwl *xwl,
                                  xcb_focus_out_event_t *event) {}
 
+// Requests the next chunk of the selection property. The reply is picked up
+// once the current chunk has been written to the target fd.
+static void xwl_fetch_selection_property(struct xwl *xwl) {
+  assert(!xwl->selection_property_fetch_pending);
+  xwl->selection_property_cookie = xcb_get_property(
+      xwl->connection, 0, xwl->selection_window,
+      xwl->atoms[ATOM_WL_SELECTION].value, XCB_GET_PROPERTY_TYPE_ANY,
+      xwl->selection_property_long_offset, SELECTION_PROPERTY_CHUNK_SIZE / 4);
+  xwl->selection_property_long_offset += SELECTION_PROPERTY_CHUNK_SIZE / 4;
+  xwl->selection_property_fetch_pending = 1;
+}
+
+static void xwl_cancel_selection_property_fetch(struct xwl *xwl) {
+  if (!xwl->selection_property_fetch_pending)
+    return;
+
+  xcb_discard_reply(xwl->connection, xwl->selection_property_cookie.sequence);
+  xwl->selection_property_fetch_pending = 0;
+}
+
+// Makes |reply| the chunk being written and starts fetching the one after
+// it, if any.
+static void xwl_set_selection_property_chunk(struct xwl *xwl,
+                                             xcb_get_property_reply_t *reply) {
+  free(xwl->selection_property_reply);
+  xwl->selection_property_reply = reply;
+  xwl->selection_property_offset = 0;
+  if (reply && reply->bytes_after)
+    xwl_fetch_selection_property(xwl);
+}
+
 static int xwl_handle_selection_fd_writable(int fd, uint32_t mask, void *data) {
   struct xwl *xwl = data;
   uint8_t *value;
   int bytes, bytes_left;
 
+  if (!xwl_bulk_budget_available(xwl))
+    return 0;
+
   value = xcb_get_property_value(xwl->selection_property_reply);
   bytes_left = xcb_get_property_value_length(xwl->selection_property_reply) -
                xwl->selection_property_offset;
 
   bytes = write(fd, value + xwl->selection_property_offset, bytes_left);
+  xwl_bulk_budget_consume(xwl, bytes);
   if (bytes == -1) {
     fprintf(stderr, "write error to target fd: %m\n");
+    xwl_cancel_selection_property_fetch(xwl);
     close(fd);
   } else if (bytes == bytes_left) {
-    if (xwl->selection_incremental_transfer) {
-      xcb_delete_property(xwl->connection, xwl->selection_window,
-                          xwl->atoms[ATOM_WL_SELECTION].value);
-    } else {
-      close(fd);
+    // Continue with the next chunk of the property.
+    if (xwl->selection_property_fetch_pending) {
+      xwl->selection_property_fetch_pending = 0;
+      xwl_set_selection_property_chunk(
+          xwl, xcb_get_property_reply(xwl->connection,
+                                      xwl->selection_property_cookie, NULL));
+      if (xwl->selection_property_reply)
+        return 1;
     }
+
+    // Deleting the property tells the selection owner that we're done
+    // with it, or ready for the next part of an incremental transfer.
+    xcb_delete_property(xwl->connection, xwl->selection_window,
+                        xwl->atoms[ATOM_WL_SELECTION].value);
+    if (!xwl->selection_incremental_transfer)
+      close(fd);
   } else {
     xwl->selection_property_offset += bytes;
     return 1;
   }
 
-  free(xwl->selection_property_reply);
-  xwl->selection_property_reply = NULL;
+  xwl_set_selection_property_chunk(xwl, NULL);
   if (xwl->selection_send_event_source) {
     wl_event_source_remove(xwl->selection_send_event_source);
     xwl->selection_send_event_source = NULL;
@@ -5516,10 +7140,13 @@ static int xwl_handle_selection_fd_writable(int fd, uint32_t mask, void *data) {
   return 1;
 }
 
+// Writes the selection property to the target fd. |reply| holds the first
+// chunk of the property and later chunks are fetched as the fd drains, so
+// only two chunks are held in memory at a time.
 static void xwl_write_selection_property(struct xwl *xwl,
                                          xcb_get_property_reply_t *reply) {
-  xwl->selection_property_offset = 0;
-  xwl->selection_property_reply = reply;
+  xwl->selection_property_long_offset = SELECTION_PROPERTY_CHUNK_SIZE / 4;
+  xwl_set_selection_property_chunk(xwl, reply);
   xwl_handle_selection_fd_writable(xwl->selection_data_source_send_fd,
                                    WL_EVENT_WRITABLE, xwl);
 
@@ -5533,121 +7160,255 @@ static void xwl_write_selection_property(struct xwl *xwl,
       xwl_handle_selection_fd_writable, xwl);
 }
 
-static void xwl_send_selection_notify(struct xwl *xwl, xcb_atom_t property) {
+static void
+xwl_send_selection_notify(struct xwl *xwl,
+                          const xcb_selection_request_event_t *request,
+                          xcb_atom_t property) {
   xcb_selection_notify_event_t event = {
       .response_type = XCB_SELECTION_NOTIFY,
       .sequence = 0,
-      .time = xwl->selection_request.time,
-      .requestor = xwl->selection_request.requestor,
-      .selection = xwl->selection_request.selection,
-      .target = xwl->selection_request.target,
+      .time = request->time,
+      .requestor = request->requestor,
+      .selection = request->selection,
+      .target = request->target,
       .property = property,
       .pad0 = 0};
 
-  xcb_send_event(xwl->connection, 0, xwl->selection_request.requestor,
+  xcb_send_event(xwl->connection, 0, request->requestor,
                  XCB_EVENT_MASK_NO_EVENT, (char *)&event);
 }
 
-static void xwl_send_selection_data(struct xwl *xwl) {
-  assert(!xwl->selection_data_ack_pending);
-  xcb_change_property(
-      xwl->connection, XCB_PROP_MODE_REPLACE, xwl->selection_request.requestor,
-      xwl->selection_request.property, xwl->atoms[ATOM_UTF8_STRING].value, 8,
-      xwl->selection_data.size, xwl->selection_data.data);
-  xwl->selection_data_ack_pending = 1;
-  xwl->selection_data.size = 0;
+static const uint32_t xwl_incr_chunk_size = 64 * 1024;
+
+static void
+xwl_selection_transfer_destroy(struct xwl_selection_transfer *transfer) {
+  wl_list_remove(&transfer->link);
+  free(transfer);
 }
 
-static const uint32_t xwl_incr_chunk_size = 64 * 1024;
+// Sends the next chunk of received data to the requestor. An empty chunk
+// is sent once all data has been sent.
+static void
+xwl_selection_transfer_send_data(struct xwl_selection_transfer *transfer) {
+  struct xwl *xwl = transfer->xwl;
+  size_t start = transfer->offset - xwl->selection_data_base;
+  size_t size = MIN(xwl->selection_data.size - start, transfer->chunk_size);
 
-static int xwl_handle_selection_fd_readable(int fd, uint32_t mask, void *data) {
-  struct xwl *xwl = data;
-  int bytes, offset, bytes_left;
-  void *p;
+  assert(!transfer->ack_pending);
+  xcb_change_property(xwl->connection, XCB_PROP_MODE_REPLACE,
+                      transfer->request.requestor, transfer->request.property,
+                      transfer->type, 8, size,
+                      (char *)xwl->selection_data.data + start);
+  transfer->ack_pending = 1;
+  transfer->send_time = xwl_now_us();
+  transfer->offset += size;
+}
 
-  offset = xwl->selection_data.size;
-  if (xwl->selection_data.size < xwl_incr_chunk_size)
-    p = wl_array_add(&xwl->selection_data, xwl_incr_chunk_size);
-  else
-    p = (char *)xwl->selection_data.data + xwl->selection_data.size;
-  bytes_left = xwl->selection_data.alloc - offset;
+// Called when the requestor has deleted the property. Chunks grow while
+// the requestor keeps up so large transfers need fewer round trips.
+static void
+xwl_selection_transfer_ack(struct xwl_selection_transfer *transfer) {
+  uint64_t latency_us = xwl_now_us() - transfer->send_time;
 
-  bytes = read(fd, p, bytes_left);
-  if (bytes == -1) {
-    fprintf(stderr, "read error from data source: %m\n");
-    xwl_send_selection_notify(xwl, XCB_ATOM_NONE);
-    xwl->selection_data_offer_receive_fd = -1;
-    close(fd);
-  } else {
-    xwl->selection_data.size = offset + bytes;
-    if (xwl->selection_data.size >= xwl_incr_chunk_size) {
-      if (!xwl->selection_incremental_transfer) {
-        xwl->selection_incremental_transfer = 1;
-        xcb_change_property(
-            xwl->connection, XCB_PROP_MODE_REPLACE,
-            xwl->selection_request.requestor, xwl->selection_request.property,
-            xwl->atoms[ATOM_INCR].value, 32, 1, &xwl_incr_chunk_size);
-        xwl->selection_data_ack_pending = 1;
-        xwl_send_selection_notify(xwl, xwl->selection_request.property);
-      } else if (!xwl->selection_data_ack_pending) {
-        xwl_send_selection_data(xwl);
-      }
-    } else if (bytes == 0) {
-      if (!xwl->selection_data_ack_pending)
-        xwl_send_selection_data(xwl);
-      if (!xwl->selection_incremental_transfer) {
-        xwl_send_selection_notify(xwl, xwl->selection_request.property);
-        xwl->selection_request.requestor = XCB_NONE;
-        wl_array_release(&xwl->selection_data);
-      }
-      xcb_flush(xwl->connection);
-      xwl->selection_data_offer_receive_fd = -1;
-      close(fd);
-    } else {
-      xwl->selection_data.size = offset + bytes;
-      return 1;
-    }
+  transfer->ack_pending = 0;
+  if (latency_us < SELECTION_INCR_FAST_ACK_US &&
+      transfer->chunk_size * 2 <= transfer->xwl->selection_max_chunk_size) {
+    transfer->chunk_size *= 2;
+  } else if (latency_us > SELECTION_INCR_SLOW_ACK_US &&
+             transfer->chunk_size / 2 >= xwl_incr_chunk_size) {
+    transfer->chunk_size /= 2;
   }
-
-  wl_event_source_remove(xwl->selection_event_source);
-  xwl->selection_event_source = NULL;
-  return 1;
 }
 
-static void xwl_handle_property_notify(struct xwl *xwl,
-                                       xcb_property_notify_event_t *event) {
-  if (event->atom == XCB_ATOM_WM_NAME) {
-    struct xwl_window *window = xwl_lookup_window(xwl, event->window);
-    if (!window)
-      return;
+static void
+xwl_selection_transfer_update(struct xwl_selection_transfer *transfer) {
+  struct xwl *xwl = transfer->xwl;
+  size_t end = xwl->selection_data_base + xwl->selection_data.size;
+  int receiving = xwl->selection_data_offer_receive_fd >= 0;
+  uint32_t lower_bound;
+
+  if (!transfer->incremental) {
+    if (end < xwl->selection_max_chunk_size) {
+      if (receiving)
+        return;
 
-    if (window->name) {
-      free(window->name);
-      window->name = NULL;
+      // All data fits in a single property.
+      xwl_selection_transfer_send_data(transfer);
+      xwl_send_selection_notify(xwl, &transfer->request,
+                                transfer->request.property);
+      xwl_selection_transfer_destroy(transfer);
+      return;
     }
 
-    if (event->state != XCB_PROPERTY_DELETE) {
-      xcb_get_property_reply_t *reply = xcb_get_property_reply(
-          xwl->connection,
-          xcb_get_property(xwl->connection, 0, window->id, XCB_ATOM_WM_NAME,
-                           XCB_ATOM_ANY, 0, 2048),
-          NULL);
-      if (reply) {
-        window->name = strndup(xcb_get_property_value(reply),
-                               xcb_get_property_value_length(reply));
-        free(reply);
-      }
-    }
+    // Property value is a lower bound on the size of the data.
+    lower_bound = MIN(end, UINT32_MAX);
+    transfer->incremental = 1;
+    xcb_change_property(xwl->connection, XCB_PROP_MODE_REPLACE,
+                        transfer->request.requestor,
+                        transfer->request.property, xwl->atoms[ATOM_INCR].value,
+                        32, 1, &lower_bound);
+    transfer->ack_pending = 1;
+    transfer->send_time = xwl_now_us();
+    xwl_send_selection_notify(xwl, &transfer->request,
+                              transfer->request.property);
+    return;
+  }
 
-    if (!window->xdg_toplevel || !xwl->show_window_title)
-      return;
+  if (transfer->ack_pending)
+    return;
 
-    if (window->name) {
-      zxdg_toplevel_v6_set_title(window->xdg_toplevel, window->name);
+  // Avoid sending empty data until transfer is complete.
+  if (transfer->offset < end) {
+    xwl_selection_transfer_send_data(transfer);
+  } else if (!receiving) {
+    xwl_selection_transfer_send_data(transfer);
+    xwl_selection_transfer_destroy(transfer);
+  }
+}
+
+static void xwl_update_selection_transfers(struct xwl *xwl) {
+  struct xwl_selection_transfer *transfer, *next;
+  size_t end = xwl->selection_data_base + xwl->selection_data.size;
+  int needs_data = 0;
+
+  wl_list_for_each_safe(transfer, next, &xwl->selection_transfers, link)
+    xwl_selection_transfer_update(transfer);
+
+  // Keep receiving while prefetching or while any requestor is short of a
+  // full chunk. This reads the next chunk ahead while the previous one
+  // waits for its ack.
+  needs_data = xwl->selection_prefetching;
+  wl_list_for_each(transfer, &xwl->selection_transfers, link) {
+    size_t wanted = transfer->incremental ? transfer->chunk_size
+                                          : xwl->selection_max_chunk_size;
+
+    if (end - transfer->offset < wanted)
+      needs_data = 1;
+  }
+
+  if (xwl->selection_event_source) {
+    wl_event_source_fd_update(xwl->selection_event_source,
+                              needs_data ? WL_EVENT_READABLE : 0);
+  }
+
+  // Queued requests are started from the transfer timer once the current
+  // receive is no longer in use.
+  if (wl_list_empty(&xwl->selection_transfers) &&
+      !wl_list_empty(&xwl->selection_queued_transfers)) {
+    wl_event_source_timer_update(xwl->selection_transfer_event_source, 1);
+  }
+
+  xwl_trim_selection_data(xwl);
+  xcb_flush(xwl->connection);
+}
+
+static void xwl_stop_selection_prefetch(struct xwl *xwl) {
+  if (!xwl->selection_prefetching)
+    return;
+
+  xwl->selection_prefetching = 0;
+  wl_event_source_timer_update(xwl->selection_prefetch_event_source, 0);
+}
+
+static void xwl_end_selection_receive(struct xwl *xwl) {
+  xwl_stop_selection_prefetch(xwl);
+  if (xwl->selection_event_source) {
+    wl_event_source_remove(xwl->selection_event_source);
+    xwl->selection_event_source = NULL;
+  }
+  if (xwl->selection_data_offer_receive_fd >= 0) {
+    close(xwl->selection_data_offer_receive_fd);
+    xwl->selection_data_offer_receive_fd = -1;
+  }
+}
+
+static void xwl_abort_selection_transfers(struct xwl *xwl) {
+  struct xwl_selection_transfer *transfer, *next;
+
+  wl_list_for_each_safe(transfer, next, &xwl->selection_transfers, link) {
+    // Requestors still waiting for a reply are told that conversion failed.
+    if (!transfer->incremental)
+      xwl_send_selection_notify(xwl, &transfer->request, XCB_ATOM_NONE);
+    xwl_selection_transfer_destroy(transfer);
+  }
+}
+
+// Cancels a prefetch unless requestors have started using the data.
+static void xwl_cancel_selection_prefetch(struct xwl *xwl) {
+  if (!xwl->selection_prefetching)
+    return;
+
+  if (wl_list_empty(&xwl->selection_transfers)) {
+    xwl_end_selection_receive(xwl);
+    xwl_invalidate_selection_cache(xwl);
+  } else {
+    xwl_stop_selection_prefetch(xwl);
+  }
+}
+
+static int xwl_handle_selection_fd_readable(int fd, uint32_t mask, void *data) {
+  struct xwl *xwl = data;
+  int bytes;
+  void *p;
+
+  if (!xwl_bulk_budget_available(xwl))
+    return 0;
+
+  p = wl_array_add(&xwl->selection_data, xwl_incr_chunk_size);
+  assert(p);
+
+  bytes = read(fd, p, xwl_incr_chunk_size);
+  xwl_bulk_budget_consume(xwl, bytes);
+  xwl->selection_data.size -= xwl_incr_chunk_size - MAX(bytes, 0);
+  if (bytes == -1) {
+    if (errno == EAGAIN || errno == EINTR)
+      return 0;
+
+    fprintf(stderr, "read error from data source: %m\n");
+    xwl_end_selection_receive(xwl);
+    xwl_abort_selection_transfers(xwl);
+    xwl_invalidate_selection_cache(xwl);
+    xcb_flush(xwl->connection);
+    return 1;
+  }
+
+  if (bytes == 0) {
+    xwl_end_selection_receive(xwl);
+  } else if (xwl->selection_prefetching) {
+    if (xwl->selection_data.size > xwl->clipboard_prefetch_size) {
+      xwl_cancel_selection_prefetch(xwl);
     } else {
-      zxdg_toplevel_v6_set_title(window->xdg_toplevel, "");
+      wl_event_source_timer_update(xwl->selection_prefetch_event_source,
+                                   xwl->clipboard_prefetch_timeout);
+    }
+  }
+
+  xwl_update_selection_transfers(xwl);
+  return 1;
+}
+
+static void xwl_handle_property_notify(struct xwl *xwl,
+                                       xcb_property_notify_event_t *event) {
+  int i;
+
+  for (i = 0; i <= PROPERTY_LAST; ++i) {
+    struct xwl_window *window;
+
+    if (event->atom != xwl_property_atom(xwl, i))
+      continue;
+
+    // Titles are tracked for all windows, other properties only for
+    // managed windows. Changes are fetched after the current batch of
+    // events has been handled.
+    window = xwl_lookup_window(xwl, event->window);
+    if (window && (window->managed || i == PROPERTY_NET_WM_NAME ||
+                   i == PROPERTY_WM_NAME)) {
+      xwl_window_set_property_dirty(window, i);
     }
-  } else if (event->atom == xwl->atoms[ATOM_WL_SELECTION].value) {
+    return;
+  }
+
+  if (event->atom == xwl->atoms[ATOM_WL_SELECTION].value) {
     if (event->window == xwl->selection_window &&
         event->state == XCB_PROPERTY_NEW_VALUE &&
         xwl->selection_incremental_transfer) {
@@ -5655,7 +7416,8 @@ static void xwl_handle_property_notify(struct xwl *xwl,
           xwl->connection,
           xcb_get_property(xwl->connection, 0, xwl->selection_window,
                            xwl->atoms[ATOM_WL_SELECTION].value,
-                           XCB_GET_PROPERTY_TYPE_ANY, 0, 0x1fffffff),
+                           XCB_GET_PROPERTY_TYPE_ANY, 0,
+                           SELECTION_PROPERTY_CHUNK_SIZE / 4),
           NULL);
 
       if (!reply)
@@ -5669,36 +7431,21 @@ static void xwl_handle_property_notify(struct xwl *xwl,
         free(reply);
       }
     }
-  } else if (event->atom == xwl->selection_request.property) {
-    if (event->window == xwl->selection_request.requestor &&
-        event->state == XCB_PROPERTY_DELETE &&
-        xwl->selection_incremental_transfer) {
-      int data_size = xwl->selection_data.size;
-
-      xwl->selection_data_ack_pending = 0;
+  } else {
+    struct xwl_selection_transfer *transfer;
 
-      // Handle the case when there's more data to be received.
-      if (xwl->selection_data_offer_receive_fd >= 0) {
-        // Avoid sending empty data until transfer is complete.
-        if (data_size)
-          xwl_send_selection_data(xwl);
+    if (event->state != XCB_PROPERTY_DELETE)
+      return;
 
-        if (!xwl->selection_event_source) {
-          xwl->selection_event_source = wl_event_loop_add_fd(
-              wl_display_get_event_loop(xwl->host_display),
-              xwl->selection_data_offer_receive_fd, WL_EVENT_READABLE,
-              xwl_handle_selection_fd_readable, xwl);
-        }
+    // Requestor deleted the property to ask for the next chunk.
+    wl_list_for_each(transfer, &xwl->selection_transfers, link) {
+      if (event->window == transfer->request.requestor &&
+          event->atom == transfer->request.property &&
+          transfer->incremental) {
+        xwl_selection_transfer_ack(transfer);
+        xwl_update_selection_transfers(xwl);
         return;
       }
-
-      xwl_send_selection_data(xwl);
-
-      // Release data if transfer is complete.
-      if (!data_size) {
-        xwl->selection_request.requestor = XCB_NONE;
-        wl_array_release(&xwl->selection_data);
-      }
     }
   }
 }
@@ -5712,15 +7459,19 @@ static void xwl_internal_data_source_send(void *data,
                                           const char *mime_type, int32_t fd) {
   struct xwl_data_source *host = data;
   struct xwl *xwl = host->xwl;
+  int i = xwl_lookup_mime_type(mime_type);
 
-  if (strcmp(mime_type, xwl_utf8_mime_type) == 0) {
+  // Data is only requested from the X client once a Wayland client asks
+  // for a specific type.
+  if (i >= 0) {
     int flags;
     int rv;
 
-    xcb_convert_selection(
-        xwl->connection, xwl->selection_window,
-        xwl->atoms[ATOM_CLIPBOARD].value, xwl->atoms[ATOM_UTF8_STRING].value,
-        xwl->atoms[ATOM_WL_SELECTION].value, XCB_CURRENT_TIME);
+    xcb_convert_selection(xwl->connection, xwl->selection_window,
+                          xwl->atoms[ATOM_CLIPBOARD].value,
+                          xwl->atoms[xwl_mime_types[i].atom].value,
+                          xwl->atoms[ATOM_WL_SELECTION].value,
+                          XCB_CURRENT_TIME);
 
     flags = fcntl(fd, F_GETFL, 0);
     rv = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
@@ -5752,6 +7503,7 @@ static void xwl_get_selection_targets(struct xwl *xwl) {
   xcb_get_property_reply_t *reply;
   xcb_atom_t *value;
   uint32_t i;
+  int j;
 
   reply = xcb_get_property_reply(
       xwl->connection,
@@ -5779,8 +7531,11 @@ static void xwl_get_selection_targets(struct xwl *xwl) {
 
     value = xcb_get_property_value(reply);
     for (i = 0; i < reply->value_len; i++) {
-      if (value[i] == xwl->atoms[ATOM_UTF8_STRING].value)
-        wl_data_source_offer(data_source->internal, xwl_utf8_mime_type);
+      for (j = 0; j < ARRAY_SIZE(xwl_mime_types); ++j) {
+        if (value[i] == xwl->atoms[xwl_mime_types[j].atom].value)
+          wl_data_source_offer(data_source->internal,
+                               xwl_mime_types[j].mime_type);
+      }
     }
 
     if (xwl->selection_data_device && xwl->default_seat) {
@@ -5802,15 +7557,18 @@ static void xwl_get_selection_targets(struct xwl *xwl) {
 static void xwl_get_selection_data(struct xwl *xwl) {
   xcb_get_property_reply_t *reply = xcb_get_property_reply(
       xwl->connection,
-      xcb_get_property(xwl->connection, 1, xwl->selection_window,
+      xcb_get_property(xwl->connection, 0, xwl->selection_window,
                        xwl->atoms[ATOM_WL_SELECTION].value,
-                       XCB_GET_PROPERTY_TYPE_ANY, 0, 0x1fffffff),
+                       XCB_GET_PROPERTY_TYPE_ANY, 0,
+                       SELECTION_PROPERTY_CHUNK_SIZE / 4),
       NULL);
   if (!reply)
     return;
 
   if (reply->type == xwl->atoms[ATOM_INCR].value) {
     xwl->selection_incremental_transfer = 1;
+    xcb_delete_property(xwl->connection, xwl->selection_window,
+                        xwl->atoms[ATOM_WL_SELECTION].value);
     free(reply);
   } else {
     xwl->selection_incremental_transfer = 0;
@@ -5829,39 +7587,54 @@ static void xwl_handle_selection_notify(struct xwl *xwl,
     xwl_get_selection_data(xwl);
 }
 
-static void xwl_send_targets(struct xwl *xwl) {
-  xcb_atom_t targets[] = {
-      xwl->atoms[ATOM_TIMESTAMP].value, xwl->atoms[ATOM_TARGETS].value,
-      xwl->atoms[ATOM_UTF8_STRING].value, xwl->atoms[ATOM_TEXT].value,
-  };
+static void xwl_send_targets(struct xwl *xwl,
+                             const xcb_selection_request_event_t *request) {
+  xcb_atom_t targets[ARRAY_SIZE(xwl_mime_types) + 3];
+  uint32_t mime_types =
+      xwl->selection_data_offer ? xwl->selection_data_offer->mime_types : 0;
+  int n = 0;
+  int i;
+
+  targets[n++] = xwl->atoms[ATOM_TIMESTAMP].value;
+  targets[n++] = xwl->atoms[ATOM_TARGETS].value;
+  for (i = 0; i < ARRAY_SIZE(xwl_mime_types); ++i) {
+    if (mime_types & (1 << i))
+      targets[n++] = xwl->atoms[xwl_mime_types[i].atom].value;
+  }
+  if (mime_types & (1 << MIME_TYPE_UTF8_TEXT))
+    targets[n++] = xwl->atoms[ATOM_TEXT].value;
 
   xcb_change_property(xwl->connection, XCB_PROP_MODE_REPLACE,
-                      xwl->selection_request.requestor,
-                      xwl->selection_request.property, XCB_ATOM_ATOM, 32,
-                      ARRAY_SIZE(targets), targets);
+                      request->requestor, request->property, XCB_ATOM_ATOM, 32,
+                      n, targets);
 
-  xwl_send_selection_notify(xwl, xwl->selection_request.property);
+  xwl_send_selection_notify(xwl, request, request->property);
 }
 
-static void xwl_send_timestamp(struct xwl *xwl) {
+static void xwl_send_timestamp(struct xwl *xwl,
+                               const xcb_selection_request_event_t *request) {
   xcb_change_property(xwl->connection, XCB_PROP_MODE_REPLACE,
-                      xwl->selection_request.requestor,
-                      xwl->selection_request.property, XCB_ATOM_INTEGER, 32, 1,
-                      &xwl->selection_timestamp);
+                      request->requestor, request->property, XCB_ATOM_INTEGER,
+                      32, 1, &xwl->selection_timestamp);
 
-  xwl_send_selection_notify(xwl, xwl->selection_request.property);
+  xwl_send_selection_notify(xwl, request, request->property);
 }
 
-static void xwl_send_data(struct xwl *xwl) {
+// Starts receiving data of |mime_type| for the current selection offer.
+// Requests for the same offer and type share this receive, which is kept
+// as a cache once complete. Callers make sure no transfer still uses the
+// previous receive.
+static int xwl_receive_selection(struct xwl *xwl, int mime_type) {
+  const char *type = xwl_mime_types[mime_type].mime_type;
+  int fd = -1;
   int rv;
 
-  if (!xwl->selection_data_offer || !xwl->selection_data_offer->utf8_text) {
-    xwl_send_selection_notify(xwl, XCB_ATOM_NONE);
-    return;
-  }
-
+  xwl_end_selection_receive(xwl);
+  xwl_abort_selection_transfers(xwl);
+  wl_array_release(&xwl->selection_data);
   wl_array_init(&xwl->selection_data);
-  xwl->selection_data_ack_pending = 0;
+  xwl->selection_data_base = 0;
+  xwl->selection_cache_offer = NULL;
 
   switch (xwl->data_driver) {
   case DATA_DRIVER_VIRTWL: {
@@ -5873,13 +7646,12 @@ static void xwl_send_data(struct xwl *xwl) {
     if (rv) {
       fprintf(stderr, "error: failed to create virtwl pipe: %s\n",
               strerror(errno));
-      xwl_send_selection_notify(xwl, XCB_ATOM_NONE);
-      return;
+      return -1;
     }
 
-    xwl->selection_data_offer_receive_fd = new_pipe.fd;
-    wl_data_offer_receive(xwl->selection_data_offer->internal,
-                          xwl_utf8_mime_type, new_pipe.fd);
+    fd = new_pipe.fd;
+    wl_data_offer_receive(xwl->selection_data_offer->internal, type,
+                          new_pipe.fd);
   } break;
   case DATA_DRIVER_NOOP: {
     int p[2];
@@ -5887,39 +7659,242 @@ static void xwl_send_data(struct xwl *xwl) {
     rv = pipe2(p, O_CLOEXEC | O_NONBLOCK);
     assert(!rv);
 
-    xwl->selection_data_offer_receive_fd = p[0];
-    wl_data_offer_receive(xwl->selection_data_offer->internal,
-                          xwl_utf8_mime_type, p[1]);
+    fd = p[0];
+    wl_data_offer_receive(xwl->selection_data_offer->internal, type, p[1]);
     close(p[1]);
   } break;
   }
 
+  xwl->selection_data_offer_receive_fd = fd;
+  xwl->selection_cache_offer = xwl->selection_data_offer;
+  xwl->selection_cache_mime_type = mime_type;
   assert(!xwl->selection_event_source);
   xwl->selection_event_source = wl_event_loop_add_fd(
-      wl_display_get_event_loop(xwl->host_display),
-      xwl->selection_data_offer_receive_fd, WL_EVENT_READABLE,
+      wl_display_get_event_loop(xwl->host_display), fd, WL_EVENT_READABLE,
       xwl_handle_selection_fd_readable, xwl);
+  return 0;
+}
+
+// Returns true if a new request for |mime_type| can be served from the
+// start of the current receive buffer.
+static int xwl_selection_receive_shareable(struct xwl *xwl, int mime_type) {
+  return xwl->selection_cache_offer &&
+         xwl->selection_cache_offer == xwl->selection_data_offer &&
+         xwl->selection_cache_mime_type == mime_type &&
+         !xwl->selection_data_base;
+}
+
+static void
+xwl_start_selection_transfer(struct xwl_selection_transfer *transfer) {
+  struct xwl *xwl = transfer->xwl;
+
+  // Transfers are checked periodically while in progress.
+  if (wl_list_empty(&xwl->selection_transfers)) {
+    wl_event_source_timer_update(xwl->selection_transfer_event_source,
+                                 SELECTION_TRANSFER_TIMEOUT_MS);
+  }
+
+  // A prefetch in progress continues as a regular receive.
+  xwl_stop_selection_prefetch(xwl);
+
+  transfer->offset = xwl->selection_data_base;
+  transfer->send_time = xwl_now_us();
+  wl_list_insert(&xwl->selection_transfers, &transfer->link);
+}
+
+// Starts the oldest queued requests once no transfer uses the current
+// receive. Requests for the same type as the oldest one start together.
+static void xwl_start_queued_selection_transfers(struct xwl *xwl) {
+  struct xwl_selection_transfer *transfer, *next;
+
+  while (wl_list_empty(&xwl->selection_transfers) &&
+         !wl_list_empty(&xwl->selection_queued_transfers)) {
+    int mime_type;
+    int available;
+
+    transfer = wl_container_of(xwl->selection_queued_transfers.prev, transfer,
+                               link);
+    mime_type = transfer->mime_type;
+    available = xwl->selection_data_offer &&
+                (xwl->selection_data_offer->mime_types & (1 << mime_type));
+    if (available && !xwl_selection_receive_shareable(xwl, mime_type))
+      available = !xwl_receive_selection(xwl, mime_type);
+
+    wl_list_for_each_safe(transfer, next, &xwl->selection_queued_transfers,
+                          link) {
+      if (transfer->mime_type != mime_type)
+        continue;
+
+      wl_list_remove(&transfer->link);
+      if (available) {
+        xwl_start_selection_transfer(transfer);
+      } else {
+        xwl_send_selection_notify(xwl, &transfer->request, XCB_ATOM_NONE);
+        free(transfer);
+      }
+    }
+  }
+}
+
+static void xwl_send_data(struct xwl *xwl,
+                          const xcb_selection_request_event_t *request,
+                          int mime_type) {
+  struct xwl_selection_transfer *transfer;
+
+  if (!xwl->selection_data_offer ||
+      !(xwl->selection_data_offer->mime_types & (1 << mime_type))) {
+    xwl_send_selection_notify(xwl, request, XCB_ATOM_NONE);
+    return;
+  }
+
+  transfer = malloc(sizeof(*transfer));
+  assert(transfer);
+  transfer->xwl = xwl;
+  transfer->request = *request;
+  transfer->mime_type = mime_type;
+  transfer->type = xwl->atoms[xwl_mime_types[mime_type].atom].value;
+  transfer->incremental = 0;
+  transfer->ack_pending = 0;
+  transfer->offset = 0;
+  transfer->chunk_size = xwl_incr_chunk_size;
+  transfer->send_time = 0;
+
+  // Requests join the current receive when they can be served from its
+  // start. Otherwise they wait for transfers in progress to finish rather
+  // than aborting them.
+  if (!xwl_selection_receive_shareable(xwl, mime_type)) {
+    if (!wl_list_empty(&xwl->selection_transfers)) {
+      wl_list_insert(&xwl->selection_queued_transfers, &transfer->link);
+      return;
+    }
+
+    if (xwl_receive_selection(xwl, mime_type)) {
+      xwl_send_selection_notify(xwl, request, XCB_ATOM_NONE);
+      free(transfer);
+      return;
+    }
+  }
+
+  xwl_start_selection_transfer(transfer);
+  xwl_update_selection_transfers(xwl);
+}
+
+// Drops transfers whose requestor stopped acknowledging chunks and starts
+// queued requests once the receive they wait for is free.
+static int xwl_handle_selection_transfer_timer(void *data) {
+  struct xwl *xwl = data;
+  struct xwl_selection_transfer *transfer, *next;
+  uint64_t now = xwl_now_us();
+
+  wl_list_for_each_safe(transfer, next, &xwl->selection_transfers, link) {
+    if (now - transfer->send_time < SELECTION_TRANSFER_TIMEOUT_MS * 1000)
+      continue;
+
+    if (transfer->incremental && transfer->ack_pending) {
+      fprintf(stderr, "warning: selection requestor 0x%x timed out\n",
+              transfer->request.requestor);
+      xwl_selection_transfer_destroy(transfer);
+    } else if (!transfer->incremental) {
+      // The source is still writing, or stalled, and the requestor is
+      // told that conversion failed.
+      fprintf(stderr, "warning: selection source timed out\n");
+      xwl_send_selection_notify(xwl, &transfer->request, XCB_ATOM_NONE);
+      xwl_selection_transfer_destroy(transfer);
+    }
+  }
+
+  // A stalled receive can't serve queued requests. They start over with a
+  // new receive.
+  if (wl_list_empty(&xwl->selection_transfers) &&
+      xwl->selection_data_offer_receive_fd >= 0 &&
+      !xwl->selection_prefetching) {
+    xwl_end_selection_receive(xwl);
+    xwl_invalidate_selection_cache(xwl);
+  }
+
+  xwl_start_queued_selection_transfers(xwl);
+  xwl_update_selection_transfers(xwl);
+
+  if (!wl_list_empty(&xwl->selection_transfers)) {
+    wl_event_source_timer_update(xwl->selection_transfer_event_source,
+                                 SELECTION_TRANSFER_TIMEOUT_MS);
+  }
+  return 0;
+}
+
+// Drops transfers to a requestor window that has been destroyed so that
+// they no longer hold on to received data.
+static void xwl_handle_selection_requestor_destroy(struct xwl *xwl,
+                                                   xcb_window_t window) {
+  struct xwl_selection_transfer *transfer, *next;
+  int dropped = 0;
+
+  wl_list_for_each_safe(transfer, next, &xwl->selection_queued_transfers,
+                        link) {
+    if (transfer->request.requestor == window) {
+      wl_list_remove(&transfer->link);
+      free(transfer);
+    }
+  }
+
+  wl_list_for_each_safe(transfer, next, &xwl->selection_transfers, link) {
+    if (transfer->request.requestor == window) {
+      xwl_selection_transfer_destroy(transfer);
+      dropped = 1;
+    }
+  }
+
+  if (dropped)
+    xwl_update_selection_transfers(xwl);
+}
+
+static int xwl_handle_selection_prefetch_timer(void *data) {
+  struct xwl *xwl = data;
+
+  // Give up on a prefetch that has not made progress within the timeout.
+  if (xwl->selection_prefetching) {
+    xwl_cancel_selection_prefetch(xwl);
+    return 0;
+  }
+
+  if (!xwl->selection_data_offer ||
+      !(xwl->selection_data_offer->mime_types & (1 << MIME_TYPE_UTF8_TEXT)))
+    return 0;
+
+  // Transfers of the previous selection are left to finish.
+  if (!wl_list_empty(&xwl->selection_transfers))
+    return 0;
+
+  if (xwl->selection_cache_offer == xwl->selection_data_offer &&
+      xwl->selection_cache_mime_type == MIME_TYPE_UTF8_TEXT)
+    return 0;
+
+  if (xwl_receive_selection(xwl, MIME_TYPE_UTF8_TEXT))
+    return 0;
+
+  xwl->selection_prefetching = 1;
+  wl_event_source_timer_update(xwl->selection_prefetch_event_source,
+                               xwl->clipboard_prefetch_timeout);
+  return 0;
 }
 
 static void xwl_handle_selection_request(struct xwl *xwl,
                                          xcb_selection_request_event_t *event) {
-  xwl->selection_request = *event;
-  xwl->selection_incremental_transfer = 0;
+  int mime_type = xwl_lookup_target_mime_type(xwl, event->target);
 
   if (event->selection == xwl->atoms[ATOM_CLIPBOARD_MANAGER].value) {
-    xwl_send_selection_notify(xwl, xwl->selection_request.property);
+    xwl_send_selection_notify(xwl, event, event->property);
     return;
   }
 
   if (event->target == xwl->atoms[ATOM_TARGETS].value) {
-    xwl_send_targets(xwl);
+    xwl_send_targets(xwl, event);
   } else if (event->target == xwl->atoms[ATOM_TIMESTAMP].value) {
-    xwl_send_timestamp(xwl);
-  } else if (event->target == xwl->atoms[ATOM_UTF8_STRING].value ||
-             event->target == xwl->atoms[ATOM_TEXT].value) {
-    xwl_send_data(xwl);
+    xwl_send_timestamp(xwl, event);
+  } else if (mime_type >= 0) {
+    xwl_send_data(xwl, event, mime_type);
   } else {
-    xwl_send_selection_notify(xwl, XCB_ATOM_NONE);
+    xwl_send_selection_notify(xwl, event, XCB_ATOM_NONE);
   }
 }
 
@@ -5956,70 +7931,195 @@ xwl_handle_xfixes_selection_notify(struct xwl *xwl,
                         xwl->atoms[ATOM_WL_SELECTION].value, event->timestamp);
 }
 
+static void xwl_handle_x_event(struct xwl *xwl, xcb_generic_event_t *event) {
+  switch (event->response_type & ~SEND_EVENT_MASK) {
+  case XCB_CREATE_NOTIFY:
+    xwl_handle_create_notify(xwl, (xcb_create_notify_event_t *)event);
+    break;
+  case XCB_DESTROY_NOTIFY:
+    xwl_handle_selection_requestor_destroy(
+        xwl, ((xcb_destroy_notify_event_t *)event)->window);
+    xwl_handle_destroy_notify(xwl, (xcb_destroy_notify_event_t *)event);
+    break;
+  case XCB_REPARENT_NOTIFY:
+    xwl_handle_reparent_notify(xwl, (xcb_reparent_notify_event_t *)event);
+    break;
+  case XCB_MAP_REQUEST:
+    xwl_handle_map_request(xwl, (xcb_map_request_event_t *)event);
+    break;
+  case XCB_MAP_NOTIFY:
+    xwl_handle_map_notify(xwl, (xcb_map_notify_event_t *)event);
+    break;
+  case XCB_UNMAP_NOTIFY:
+    xwl_handle_unmap_notify(xwl, (xcb_unmap_notify_event_t *)event);
+    break;
+  case XCB_CONFIGURE_REQUEST:
+    xwl_handle_configure_request(xwl, (xcb_configure_request_event_t *)event);
+    break;
+  case XCB_CONFIGURE_NOTIFY:
+    xwl_handle_configure_notify(xwl, (xcb_configure_notify_event_t *)event);
+    break;
+  case XCB_CLIENT_MESSAGE:
+    xwl_handle_client_message(xwl, (xcb_client_message_event_t *)event);
+    break;
+  case XCB_FOCUS_IN:
+    xwl_handle_focus_in(xwl, (xcb_focus_in_event_t *)event);
+    break;
+  case XCB_FOCUS_OUT:
+    xwl_handle_focus_out(xwl, (xcb_focus_out_event_t *)event);
+    break;
+  case XCB_PROPERTY_NOTIFY:
+    xwl_handle_property_notify(xwl, (xcb_property_notify_event_t *)event);
+    break;
+  case XCB_SELECTION_NOTIFY:
+    xwl_handle_selection_notify(xwl, (xcb_selection_notify_event_t *)event);
+    break;
+  case XCB_SELECTION_REQUEST:
+    xwl_handle_selection_request(xwl, (xcb_selection_request_event_t *)event);
+    break;
+  }
+
+  switch (event->response_type - xwl->xfixes_extension->first_event) {
+  case XCB_XFIXES_SELECTION_NOTIFY:
+    xwl_handle_xfixes_selection_notify(
+        xwl, (xcb_xfixes_selection_notify_event_t *)event);
+    break;
+  }
+}
+
+// Returns the window that |event| applies to or XCB_WINDOW_NONE if the
+// event is not specific to a window.
+static xcb_window_t xwl_x_event_window(xcb_generic_event_t *event) {
+  switch (event->response_type & ~SEND_EVENT_MASK) {
+  case XCB_CREATE_NOTIFY:
+    return ((xcb_create_notify_event_t *)event)->window;
+  case XCB_DESTROY_NOTIFY:
+    return ((xcb_destroy_notify_event_t *)event)->window;
+  case XCB_REPARENT_NOTIFY:
+    return ((xcb_reparent_notify_event_t *)event)->window;
+  case XCB_MAP_REQUEST:
+    return ((xcb_map_request_event_t *)event)->window;
+  case XCB_MAP_NOTIFY:
+    return ((xcb_map_notify_event_t *)event)->window;
+  case XCB_UNMAP_NOTIFY:
+    return ((xcb_unmap_notify_event_t *)event)->window;
+  case XCB_CONFIGURE_REQUEST:
+    return ((xcb_configure_request_event_t *)event)->window;
+  case XCB_CONFIGURE_NOTIFY:
+    return ((xcb_configure_notify_event_t *)event)->window;
+  case XCB_CLIENT_MESSAGE:
+    return ((xcb_client_message_event_t *)event)->window;
+  case XCB_FOCUS_IN:
+    return ((xcb_focus_in_event_t *)event)->event;
+  case XCB_FOCUS_OUT:
+    return ((xcb_focus_out_event_t *)event)->event;
+  case XCB_PROPERTY_NOTIFY:
+    return ((xcb_property_notify_event_t *)event)->window;
+  }
+  return XCB_WINDOW_NONE;
+}
+
+// Adds the values of |src| that are not set in |dst| to |dst|.
+static void xwl_merge_configure_request(xcb_configure_request_event_t *dst,
+                                        xcb_configure_request_event_t *src) {
+  uint16_t mask = src->value_mask & ~dst->value_mask;
+
+  // Sibling is only meaningful together with stack mode.
+  if (mask & XCB_CONFIG_WINDOW_STACK_MODE) {
+    mask |= src->value_mask & XCB_CONFIG_WINDOW_SIBLING;
+    dst->sibling = src->sibling;
+    dst->stack_mode = src->stack_mode;
+  } else {
+    mask &= ~XCB_CONFIG_WINDOW_SIBLING;
+  }
+  if (mask & XCB_CONFIG_WINDOW_X)
+    dst->x = src->x;
+  if (mask & XCB_CONFIG_WINDOW_Y)
+    dst->y = src->y;
+  if (mask & XCB_CONFIG_WINDOW_WIDTH)
+    dst->width = src->width;
+  if (mask & XCB_CONFIG_WINDOW_HEIGHT)
+    dst->height = src->height;
+  if (mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+    dst->border_width = src->border_width;
+  dst->value_mask |= mask;
+}
+
+// Drops configure events that are superseded by a later configure event of
+// the same type for the same window. A superseded ConfigureRequest is merged
+// into the later request. Any other event for the window except
+// PropertyNotify, which is handled after the batch, prevents coalescing.
+// Dropped events are freed and set to NULL.
+static void xwl_coalesce_x_events(xcb_generic_event_t **events, int count) {
+  int i, j;
+
+  for (i = 0; i < count; ++i) {
+    uint8_t type = events[i]->response_type;
+    xcb_window_t window;
+
+    if ((type & ~SEND_EVENT_MASK) != XCB_CONFIGURE_REQUEST &&
+        (type & ~SEND_EVENT_MASK) != XCB_CONFIGURE_NOTIFY) {
+      continue;
+    }
+
+    window = xwl_x_event_window(events[i]);
+    for (j = i + 1; j < count; ++j) {
+      if (!events[j])
+        continue;
+      if ((events[j]->response_type & ~SEND_EVENT_MASK) == XCB_PROPERTY_NOTIFY)
+        continue;
+      if (xwl_x_event_window(events[j]) == window)
+        break;
+    }
+    if (j == count || events[j]->response_type != type)
+      continue;
+
+    if ((type & ~SEND_EVENT_MASK) == XCB_CONFIGURE_REQUEST) {
+      xwl_merge_configure_request((xcb_configure_request_event_t *)events[j],
+                                  (xcb_configure_request_event_t *)events[i]);
+    }
+    free(events[i]);
+    events[i] = NULL;
+  }
+}
+
 static int xwl_handle_x_connection_event(int fd, uint32_t mask, void *data) {
   struct xwl *xwl = (struct xwl *)data;
-  xcb_generic_event_t *event;
+  xcb_generic_event_t *event, **events;
+  struct wl_array batch;
   uint32_t count = 0;
+  int i, n;
 
   if ((mask & WL_EVENT_HANGUP) || (mask & WL_EVENT_ERROR))
     return 0;
 
-  while ((event = xcb_poll_for_event(xwl->connection))) {
-    switch (event->response_type & ~SEND_EVENT_MASK) {
-    case XCB_CREATE_NOTIFY:
-      xwl_handle_create_notify(xwl, (xcb_create_notify_event_t *)event);
-      break;
-    case XCB_DESTROY_NOTIFY:
-      xwl_handle_destroy_notify(xwl, (xcb_destroy_notify_event_t *)event);
-      break;
-    case XCB_REPARENT_NOTIFY:
-      xwl_handle_reparent_notify(xwl, (xcb_reparent_notify_event_t *)event);
-      break;
-    case XCB_MAP_REQUEST:
-      xwl_handle_map_request(xwl, (xcb_map_request_event_t *)event);
-      break;
-    case XCB_MAP_NOTIFY:
-      xwl_handle_map_notify(xwl, (xcb_map_notify_event_t *)event);
-      break;
-    case XCB_UNMAP_NOTIFY:
-      xwl_handle_unmap_notify(xwl, (xcb_unmap_notify_event_t *)event);
-      break;
-    case XCB_CONFIGURE_REQUEST:
-      xwl_handle_configure_request(xwl, (xcb_configure_request_event_t *)event);
-      break;
-    case XCB_CONFIGURE_NOTIFY:
-      xwl_handle_configure_notify(xwl, (xcb_configure_notify_event_t *)event);
-      break;
-    case XCB_CLIENT_MESSAGE:
-      xwl_handle_client_message(xwl, (xcb_client_message_event_t *)event);
-      break;
-    case XCB_FOCUS_IN:
-      xwl_handle_focus_in(xwl, (xcb_focus_in_event_t *)event);
-      break;
-    case XCB_FOCUS_OUT:
-      xwl_handle_focus_out(xwl, (xcb_focus_out_event_t *)event);
-      break;
-    case XCB_PROPERTY_NOTIFY:
-      xwl_handle_property_notify(xwl, (xcb_property_notify_event_t *)event);
-      break;
-    case XCB_SELECTION_NOTIFY:
-      xwl_handle_selection_notify(xwl, (xcb_selection_notify_event_t *)event);
-      break;
-    case XCB_SELECTION_REQUEST:
-      xwl_handle_selection_request(xwl, (xcb_selection_request_event_t *)event);
-      break;
+  wl_array_init(&batch);
+  do {
+    // Drain all pending events before handling any of them so that
+    // superseded configure events can be dropped.
+    while ((event = xcb_poll_for_event(xwl->connection))) {
+      events = wl_array_add(&batch, sizeof(event));
+      assert(events);
+      *events = event;
     }
 
-    switch (event->response_type - xwl->xfixes_extension->first_event) {
-    case XCB_XFIXES_SELECTION_NOTIFY:
-      xwl_handle_xfixes_selection_notify(
-          xwl, (xcb_xfixes_selection_notify_event_t *)event);
-      break;
+    events = batch.data;
+    n = batch.size / sizeof(event);
+    xwl_coalesce_x_events(events, n);
+    for (i = 0; i < n; ++i) {
+      if (!events[i])
+        continue;
+
+      xwl_handle_x_event(xwl, events[i]);
+      free(events[i]);
     }
+    batch.size = 0;
+    count += n;
 
-    free(event);
-    ++count;
-  }
+    // Events can be queued while waiting for replies so poll again before
+    // and after updating window properties.
+  } while (n || xwl_update_dirty_window_properties(xwl));
+  wl_array_release(&batch);
 
   if ((mask & ~WL_EVENT_WRITABLE) == 0)
     xcb_flush(xwl->connection);
@@ -6027,24 +8127,97 @@ static int xwl_handle_x_connection_event(int fd, uint32_t mask, void *data) {
   return count;
 }
 
-static void xwl_connect(struct xwl *xwl) {
-  const char wm_name[] = "Sommelier";
-  const xcb_setup_t *setup;
-  xcb_screen_iterator_t screen_iterator;
-  uint32_t values[1];
-  xcb_void_cookie_t change_attributes_cookie, redirect_subwindows_cookie;
-  xcb_generic_error_t *error;
-  xcb_intern_atom_reply_t *atom_reply;
-  xcb_depth_iterator_t depth_iterator;
-  xcb_xfixes_query_version_reply_t *xfixes_query_version_reply;
-  const xcb_query_extension_reply_t *composite_extension;
-  unsigned i;
+// Adopts windows that X clients created before the window manager was
+// set up, which happens when clients connect to Xwayland while sommelier is
+// still connecting. Mapped windows are managed as if they had just been
+// mapped, and mapped override-redirect windows are mapped again so that
+// Xwayland announces their surfaces.
+static void xwl_adopt_windows(struct xwl *xwl) {
+  xcb_query_tree_reply_t *reply;
+  xcb_window_t *children;
+  xcb_get_geometry_cookie_t *geometry_cookies;
+  xcb_get_window_attributes_cookie_t *attributes_cookies;
+  int length;
+  int i;
 
-  xwl->connection = xcb_connect_to_fd(xwl->wm_fd, NULL);
-  assert(!xcb_connection_has_error(xwl->connection));
+  reply = xcb_query_tree_reply(
+      xwl->connection, xcb_query_tree(xwl->connection, xwl->screen->root),
+      NULL);
+  if (!reply)
+    return;
+
+  children = xcb_query_tree_children(reply);
+  length = xcb_query_tree_children_length(reply);
+  geometry_cookies = malloc(sizeof(*geometry_cookies) * MAX(length, 1));
+  assert(geometry_cookies);
+  attributes_cookies = malloc(sizeof(*attributes_cookies) * MAX(length, 1));
+  assert(attributes_cookies);
+
+  for (i = 0; i < length; ++i) {
+    geometry_cookies[i] = xcb_get_geometry(xwl->connection, children[i]);
+    attributes_cookies[i] =
+        xcb_get_window_attributes(xwl->connection, children[i]);
+  }
+
+  for (i = 0; i < length; ++i) {
+    xcb_get_geometry_reply_t *geometry_reply =
+        xcb_get_geometry_reply(xwl->connection, geometry_cookies[i], NULL);
+    xcb_get_window_attributes_reply_t *attributes_reply =
+        xcb_get_window_attributes_reply(xwl->connection, attributes_cookies[i],
+                                        NULL);
+
+    if (geometry_reply && attributes_reply &&
+        !xwl_is_our_window(xwl, children[i]) &&
+        !xwl_lookup_window(xwl, children[i])) {
+      xwl_create_window(xwl, children[i], geometry_reply->x, geometry_reply->y,
+                        geometry_reply->width, geometry_reply->height,
+                        geometry_reply->border_width);
+
+      if (attributes_reply->map_state == XCB_MAP_STATE_VIEWABLE) {
+        if (attributes_reply->override_redirect) {
+          xcb_unmap_window(xwl->connection, children[i]);
+          xcb_map_window(xwl->connection, children[i]);
+        } else {
+          xcb_map_request_event_t event = {
+              .response_type = XCB_MAP_REQUEST,
+              .parent = xwl->screen->root,
+              .window = children[i],
+          };
+
+          xwl_handle_map_request(xwl, &event);
+        }
+      }
+    }
+
+    free(geometry_reply);
+    free(attributes_reply);
+  }
+
+  free(geometry_cookies);
+  free(attributes_cookies);
+  free(reply);
+}
+
+static void xwl_connect(struct xwl *xwl) {
+  const char wm_name[] = "Sommelier";
+  const xcb_setup_t *setup;
+  xcb_screen_iterator_t screen_iterator;
+  uint32_t values[1];
+  xcb_void_cookie_t change_attributes_cookie, redirect_subwindows_cookie;
+  xcb_xfixes_query_version_cookie_t xfixes_query_version_cookie;
+  xcb_generic_error_t *error;
+  xcb_intern_atom_reply_t *atom_reply;
+  xcb_depth_iterator_t depth_iterator;
+  xcb_xfixes_query_version_reply_t *xfixes_query_version_reply;
+  const xcb_query_extension_reply_t *composite_extension;
+  unsigned i;
+
+  xwl->connection = xcb_connect_to_fd(xwl->wm_fd, NULL);
+  assert(!xcb_connection_has_error(xwl->connection));
 
   xcb_prefetch_extension_data(xwl->connection, &xcb_xfixes_id);
   xcb_prefetch_extension_data(xwl->connection, &xcb_composite_id);
+  xcb_prefetch_maximum_request_length(xwl->connection);
 
   for (i = 0; i < ARRAY_SIZE(xwl->atoms); ++i) {
     const char *name = xwl->atoms[i].name;
@@ -6072,14 +8245,17 @@ static void xwl_connect(struct xwl *xwl) {
       xcb_get_extension_data(xwl->connection, &xcb_xfixes_id);
   assert(xwl->xfixes_extension->present);
 
-  xfixes_query_version_reply = xcb_xfixes_query_version_reply(
-      xwl->connection,
-      xcb_xfixes_query_version(xwl->connection, XCB_XFIXES_MAJOR_VERSION,
-                               XCB_XFIXES_MINOR_VERSION),
-      NULL);
-  assert(xfixes_query_version_reply);
-  assert(xfixes_query_version_reply->major_version >= 5);
-  free(xfixes_query_version_reply);
+  // The reply is collected with the other setup replies below so that it
+  // doesn't cost a round trip of its own.
+  xfixes_query_version_cookie = xcb_xfixes_query_version(
+      xwl->connection, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
+
+  // Limit selection chunks to what fits in a single ChangeProperty request,
+  // which is larger when the server supports BIG-REQUESTS.
+  xwl->selection_max_chunk_size =
+      MIN(SELECTION_INCR_MAX_CHUNK_SIZE,
+          xcb_get_maximum_request_length(xwl->connection) * 4 -
+              sizeof(xcb_change_property_request_t) - 4);
 
   composite_extension =
       xcb_get_extension_data(xwl->connection, &xcb_composite_id);
@@ -6096,6 +8272,12 @@ static void xwl_connect(struct xwl *xwl) {
   error = xcb_request_check(xwl->connection, redirect_subwindows_cookie);
   assert(!error);
 
+  xfixes_query_version_reply = xcb_xfixes_query_version_reply(
+      xwl->connection, xfixes_query_version_cookie, NULL);
+  assert(xfixes_query_version_reply);
+  assert(xfixes_query_version_reply->major_version >= 5);
+  free(xfixes_query_version_reply);
+
   xwl->window = xcb_generate_id(xwl->connection);
   xcb_create_window(xwl->connection, 0, xwl->window, xwl->screen->root, 0, 0, 1,
                     1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0,
@@ -6163,6 +8345,10 @@ static void xwl_connect(struct xwl *xwl) {
 
   xcb_set_input_focus(xwl->connection, XCB_INPUT_FOCUS_NONE, XCB_NONE,
                       XCB_CURRENT_TIME);
+
+  // Windows mapped before substructure redirect took effect never sent a
+  // MapRequest.
+  xwl_adopt_windows(xwl);
   xcb_flush(xwl->connection);
 }
 
@@ -6209,44 +8395,22 @@ static void xwl_execvp(const char *file, char *const argv[],
   perror(file);
 }
 
-static void xwl_sd_notify(const char *state) {
-  const char *socket_name;
-  struct msghdr msghdr;
-  struct iovec iovec;
-  struct sockaddr_un addr;
-  int fd;
+// Lets the program that was started ahead of time exec with |display_name|.
+static void xwl_start_child(struct xwl *xwl, const char *display_name) {
   int rv;
 
-  socket_name = getenv("NOTIFY_SOCKET");
-  assert(socket_name);
-
-  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
-  assert(fd >= 0);
-
-  memset(&addr, 0, sizeof(addr));
-  addr.sun_family = AF_UNIX;
-  strncpy(addr.sun_path, socket_name, sizeof(addr.sun_path));
-
-  memset(&iovec, 0, sizeof(iovec));
-  iovec.iov_base = (char *)state;
-  iovec.iov_len = strlen(state);
-
-  memset(&msghdr, 0, sizeof(msghdr));
-  msghdr.msg_name = &addr;
-  msghdr.msg_namelen =
-      offsetof(struct sockaddr_un, sun_path) + strlen(socket_name);
-  msghdr.msg_iov = &iovec;
-  msghdr.msg_iovlen = 1;
+  rv = write(xwl->child_ready_fd, display_name, strlen(display_name));
+  assert(rv == strlen(display_name));
+  close(xwl->child_ready_fd);
+  xwl->child_ready_fd = -1;
 
-  rv = sendmsg(fd, &msghdr, MSG_NOSIGNAL);
-  assert(rv != -1);
+  xwl_startup_milestone(xwl, STARTUP_CHILD_SPAWNED);
 }
 
 static int xwl_handle_display_ready_event(int fd, uint32_t mask, void *data) {
   struct xwl *xwl = (struct xwl *)data;
   char display_name[9];
   int bytes_read = 0;
-  pid_t pid;
 
   if (!(mask & WL_EVENT_READABLE))
     return 0;
@@ -6268,8 +8432,10 @@ static int xwl_handle_display_ready_event(int fd, uint32_t mask, void *data) {
 
   display_name[bytes_read] = '\0';
   setenv("DISPLAY", display_name, 1);
+  xwl_startup_milestone(xwl, STARTUP_XWAYLAND_READY);
 
   xwl_connect(xwl);
+  xwl_startup_milestone(xwl, STARTUP_WM_CONNECTED);
 
   wl_event_source_remove(xwl->display_ready_event_source);
   xwl->display_ready_event_source = NULL;
@@ -6278,16 +8444,107 @@ static int xwl_handle_display_ready_event(int fd, uint32_t mask, void *data) {
   if (xwl->sd_notify)
     xwl_sd_notify(xwl->sd_notify);
 
-  pid = fork();
-  assert(pid >= 0);
-  if (pid == 0) {
-    xwl_execvp(xwl->runprog[0], xwl->runprog, -1);
-    _exit(EXIT_FAILURE);
+  // With lazy startup, the program is already running.
+  if (xwl->child_ready_fd >= 0)
+    xwl_start_child(xwl, display_name);
+
+  return 1;
+}
+
+// Paths removed when the process that registered them exits. Forked
+// children that exit without exec leave them in place.
+static struct {
+  pid_t pid;
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} xwl_exit_unlink_paths[MAX_EXIT_UNLINK_PATHS];
+static int xwl_exit_unlink_count;
+
+static void xwl_unlink_exit_paths(void) {
+  int i;
+
+  for (i = 0; i < xwl_exit_unlink_count; ++i) {
+    if (xwl_exit_unlink_paths[i].pid == getpid())
+      unlink(xwl_exit_unlink_paths[i].path);
   }
+}
 
-  xwl->child_pid = pid;
+static void xwl_unlink_at_exit(const char *path) {
+  assert(xwl_exit_unlink_count < MAX_EXIT_UNLINK_PATHS);
+  if (!xwl_exit_unlink_count)
+    atexit(xwl_unlink_exit_paths);
 
-  return 1;
+  xwl_exit_unlink_paths[xwl_exit_unlink_count].pid = getpid();
+  snprintf(xwl_exit_unlink_paths[xwl_exit_unlink_count].path,
+           sizeof(xwl_exit_unlink_paths[xwl_exit_unlink_count].path), "%s",
+           path);
+  ++xwl_exit_unlink_count;
+}
+
+static int xwl_handle_exit_signal(int signal_number, void *data) {
+  exit(EXIT_SUCCESS);
+}
+
+// Binds the listening socket for X display |*display|, or the first free
+// display if it is negative, so that Xwayland can be started when the first
+// X client connects. The lock file and socket are removed at exit. Returns
+// the socket, or -1 on failure.
+static int xwl_open_x_display(int *display) {
+  int first = *display >= 0 ? *display : 0;
+  int last = *display >= 0 ? *display : 32;
+  int n;
+
+  // The socket directory is normally created by the X server. Sticky and
+  // world writable like /tmp, so that other users' servers can use it.
+  if (!mkdir("/tmp/.X11-unix", 01777)) {
+    chmod("/tmp/.X11-unix", 01777);
+  } else if (errno != EEXIST) {
+    fprintf(stderr, "error: unable to create /tmp/.X11-unix: %s\n",
+            strerror(errno));
+    return -1;
+  }
+
+  for (n = first; n <= last; ++n) {
+    struct sockaddr_un addr = {.sun_family = AF_LOCAL};
+    char lock_path[64];
+    char pid_str[12];
+    int lock_fd;
+    int fd;
+
+    snprintf(lock_path, sizeof(lock_path), "/tmp/.X%d-lock", n);
+    lock_fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+    if (lock_fd < 0)
+      continue;
+
+    snprintf(pid_str, sizeof(pid_str), "%10d\n", getpid());
+    if (write(lock_fd, pid_str, strlen(pid_str)) != strlen(pid_str)) {
+      fprintf(stderr, "error: unable to write %s: %s\n", lock_path,
+              strerror(errno));
+      close(lock_fd);
+      unlink(lock_path);
+      return -1;
+    }
+    close(lock_fd);
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/.X11-unix/X%d", n);
+    unlink(addr.sun_path);
+
+    fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    assert(fd >= 0);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 1) < 0) {
+      close(fd);
+      unlink(lock_path);
+      continue;
+    }
+
+    xwl_unlink_at_exit(lock_path);
+    xwl_unlink_at_exit(addr.sun_path);
+    *display = n;
+    return fd;
+  }
+
+  return -1;
 }
 
 static void xwl_sigchld_handler(int signal) {
@@ -6399,28 +8656,113 @@ xwl_set_display_implementation(struct wl_resource *resource, void *user_data) {
   return WL_ITERATOR_CONTINUE;
 }
 
-static int xwl_handle_virtwl_ctx_event(int fd, uint32_t mask, void *data) {
+// Accepts a connection to the master socket and serves it from this
+// process, sharing the host connection and globals with other clients.
+static int xwl_handle_master_connection(int fd, uint32_t mask, void *data) {
+  struct xwl *xwl = (struct xwl *)data;
+  struct wl_client *client;
+  int client_fd;
+
+  client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+  if (client_fd < 0) {
+    fprintf(stderr, "error: failed to accept: %m\n");
+    return 0;
+  }
+
+  client = wl_client_create(xwl->host_display, client_fd);
+  if (!client) {
+    fprintf(stderr, "error: failed to create client\n");
+    return 0;
+  }
+
+  wl_client_for_each_resource(client, xwl_set_display_implementation, xwl);
+
+  return 1;
+}
+
+static void xwl_create_client(struct xwl *xwl, int client_fd) {
+  // Programs are started before the host globals are known. Hold off on
+  // serving their connection so that they see a complete registry.
+  if (!xwl->registry_complete) {
+    xwl->pending_client_fd = client_fd;
+    return;
+  }
+
+  xwl->client = wl_client_create(xwl->host_display, client_fd);
+
+  // Replace the core display implementation. This is needed in order to
+  // implement sync handler properly.
+  wl_client_for_each_resource(xwl->client, xwl_set_display_implementation,
+                              xwl);
+
+  wl_client_add_destroy_listener(xwl->client, &xwl->client_destroy_listener);
+}
+
+static void xwl_registry_sync_done(void *data, struct wl_callback *callback,
+                                   uint32_t serial) {
+  struct xwl *xwl = (struct xwl *)data;
+
+  wl_callback_destroy(callback);
+  xwl->registry_complete = 1;
+  xwl_startup_milestone(xwl, STARTUP_REGISTRY_COMPLETE);
+
+  if (xwl->pending_client_fd >= 0) {
+    xwl_create_client(xwl, xwl->pending_client_fd);
+    xwl->pending_client_fd = -1;
+  }
+}
+
+static const struct wl_callback_listener xwl_registry_sync_listener = {
+    xwl_registry_sync_done};
+
+// Receives a client connection and its peer pid from the master. Workers
+// exit when the master goes away before handing over a client.
+static int xwl_handle_worker_event(int fd, uint32_t mask, void *data) {
   struct xwl *xwl = (struct xwl *)data;
-  uint8_t ioctl_buffer[4096];
-  struct virtwl_ioctl_txn *ioctl_recv = (struct virtwl_ioctl_txn *)ioctl_buffer;
-  void *recv_data = ioctl_buffer + sizeof(struct virtwl_ioctl_txn);
-  size_t max_recv_size = sizeof(ioctl_buffer) - sizeof(struct virtwl_ioctl_txn);
+  char fd_buffer[CMSG_LEN(sizeof(int))];
+  pid_t peer_pid;
+  struct iovec iov = {.iov_base = &peer_pid, .iov_len = sizeof(peer_pid)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = fd_buffer,
+                       .msg_controllen = sizeof(fd_buffer)};
+  struct cmsghdr *cmsg;
+  ssize_t bytes;
+  int client_fd;
+
+  bytes = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  if (bytes <= 0)
+    exit(EXIT_SUCCESS);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (bytes != sizeof(peer_pid) || !cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "error: invalid message from master\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&client_fd, CMSG_DATA(cmsg), sizeof(client_fd));
+
+  wl_event_source_remove(xwl->worker_event_source);
+  xwl->worker_event_source = NULL;
+  close(xwl->worker_fd);
+  xwl->worker_fd = -1;
+
+  xwl->peer_pid = peer_pid;
+  xwl_create_client(xwl, client_fd);
+
+  return 1;
+}
+
+// Forwards a message received from the virtwl context to the socket.
+static void xwl_virtwl_forward_to_socket(struct xwl *xwl,
+                                         struct virtwl_ioctl_txn *ioctl_recv) {
   char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
   struct msghdr msg = {0};
   struct iovec buffer_iov;
   ssize_t bytes;
   int fd_count;
-  int rv;
-
-  ioctl_recv->len = max_recv_size;
-  rv = ioctl(fd, VIRTWL_IOCTL_RECV, ioctl_recv);
-  if (rv) {
-    close(xwl->virtwl_socket_fd);
-    xwl->virtwl_socket_fd = -1;
-    return 0;
-  }
 
-  buffer_iov.iov_base = recv_data;
+  buffer_iov.iov_base = ioctl_recv->data;
   buffer_iov.iov_len = ioctl_recv->len;
 
   msg.msg_iov = &buffer_iov;
@@ -6452,66 +8794,680 @@ static int xwl_handle_virtwl_ctx_event(int fd, uint32_t mask, void *data) {
 
   while (fd_count--)
     close(ioctl_recv->fds[fd_count]);
+}
+
+static int xwl_handle_virtwl_ctx_event(int fd, uint32_t mask, void *data) {
+  struct xwl *xwl = (struct xwl *)data;
+  uint8_t stack_buffer[VIRTWL_DEFAULT_BUFFER_SIZE];
+  uint8_t *ioctl_buffer = stack_buffer;
+  size_t buffer_size = sizeof(stack_buffer);
+  struct virtwl_ioctl_txn *ioctl_recv;
+  size_t max_recv_size;
+  int rv;
+
+  // Transaction size is not known before receiving, so a larger buffer is
+  // always used when one has been configured.
+  if (xwl->virtwl_recv_buffer) {
+    ioctl_buffer = xwl->virtwl_recv_buffer;
+    buffer_size = xwl->virtwl_buffer_size;
+  }
+  ioctl_recv = (struct virtwl_ioctl_txn *)ioctl_buffer;
+  max_recv_size = buffer_size - sizeof(struct virtwl_ioctl_txn);
+
+  ++xwl->stats.virtwl_wakeups;
+
+  // The context fd is non-blocking so everything that is queued can be
+  // forwarded before returning to the event loop.
+  for (;;) {
+    ioctl_recv->len = max_recv_size;
+    rv = ioctl(fd, VIRTWL_IOCTL_RECV, ioctl_recv);
+    if (rv) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+
+      close(xwl->virtwl_socket_fd);
+      xwl->virtwl_socket_fd = -1;
+      return 0;
+    }
+
+    xwl_virtwl_forward_to_socket(xwl, ioctl_recv);
+    ++xwl->stats.virtwl_messages;
+  }
 
   return 1;
 }
 
+static void xwl_virtwl_send(struct xwl *xwl,
+                            struct virtwl_ioctl_txn *ioctl_send, size_t len,
+                            int fd_count) {
+  int rv;
+  int i;
+
+  for (i = fd_count; i < VIRTWL_SEND_MAX_ALLOCS; ++i)
+    ioctl_send->fds[i] = -1;
+
+  // The FDs and data were extracted from the recvmsg calls into the
+  // ioctl_send structure which we now pass along to the kernel.
+  ioctl_send->len = len;
+  rv = ioctl(xwl->virtwl_ctx_fd, VIRTWL_IOCTL_SEND, ioctl_send);
+  assert(!rv);
+
+  while (fd_count--)
+    close(ioctl_send->fds[fd_count]);
+}
+
 static int xwl_handle_virtwl_socket_event(int fd, uint32_t mask, void *data) {
   struct xwl *xwl = (struct xwl *)data;
-  uint8_t ioctl_buffer[4096];
-  struct virtwl_ioctl_txn *ioctl_send = (struct virtwl_ioctl_txn *)ioctl_buffer;
-  void *send_data = ioctl_buffer + sizeof(struct virtwl_ioctl_txn);
-  size_t max_send_size = sizeof(ioctl_buffer) - sizeof(struct virtwl_ioctl_txn);
+  uint8_t stack_buffer[VIRTWL_DEFAULT_BUFFER_SIZE];
+  uint8_t *ioctl_buffer = stack_buffer;
+  size_t buffer_size = sizeof(stack_buffer);
+  struct virtwl_ioctl_txn *ioctl_send;
+  uint8_t *send_data;
+  size_t max_send_size;
   char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
+  int fds[VIRTWL_SEND_MAX_ALLOCS];
   struct iovec buffer_iov;
-  struct msghdr msg = {0};
+  struct msghdr msg;
   struct cmsghdr *cmsg;
   ssize_t bytes;
+  size_t len = 0;
   int fd_count = 0;
+  int pending;
+
+  ++xwl->stats.virtwl_wakeups;
+
+  // Small amounts of queued data are sent from the stack buffer. The larger
+  // buffer is only used when more data is queued than fits on the stack.
+  if (xwl->virtwl_send_buffer && !ioctl(fd, FIONREAD, &pending) &&
+      pending > sizeof(stack_buffer) - sizeof(struct virtwl_ioctl_txn)) {
+    ioctl_buffer = xwl->virtwl_send_buffer;
+    buffer_size = xwl->virtwl_buffer_size;
+  }
+  ioctl_send = (struct virtwl_ioctl_txn *)ioctl_buffer;
+  send_data = ioctl_buffer + sizeof(struct virtwl_ioctl_txn);
+  max_send_size = buffer_size - sizeof(struct virtwl_ioctl_txn);
+
+  // The socket is a byte stream, so data from several messages can be sent
+  // to the host in a single transaction as long as their FDs fit.
+  for (;;) {
+    int msg_fd_count = 0;
+
+    if (len == max_send_size) {
+      xwl_virtwl_send(xwl, ioctl_send, len, fd_count);
+      len = 0;
+      fd_count = 0;
+    }
+
+    buffer_iov.iov_base = send_data + len;
+    buffer_iov.iov_len = max_send_size - len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &buffer_iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = fd_buffer;
+    msg.msg_controllen = sizeof(fd_buffer);
+
+    bytes = recvmsg(xwl->virtwl_socket_fd, &msg, MSG_DONTWAIT);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    assert(bytes > 0);
+
+    // If there were any FDs recv'd by recvmsg, there will be some data in
+    // the msg_control buffer. To get the FDs out we iterate all cmsghdr's
+    // within and unpack the FDs if the cmsghdr type is SCM_RIGHTS.
+    for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      size_t cmsg_fd_count;
+
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+
+      cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+      // msg_fd_count will never exceed VIRTWL_SEND_MAX_ALLOCS because the
+      // control message buffer only allocates enough space for that many
+      // FDs.
+      memcpy(&fds[msg_fd_count], CMSG_DATA(cmsg), cmsg_fd_count * sizeof(int));
+      msg_fd_count += cmsg_fd_count;
+    }
+
+    // Send what has been gathered so far if the FDs of this message don't
+    // fit in the same transaction.
+    if (fd_count + msg_fd_count > VIRTWL_SEND_MAX_ALLOCS) {
+      xwl_virtwl_send(xwl, ioctl_send, len, fd_count);
+      memmove(send_data, send_data + len, bytes);
+      len = 0;
+      fd_count = 0;
+    }
+
+    memcpy(&ioctl_send->fds[fd_count], fds, msg_fd_count * sizeof(int));
+    fd_count += msg_fd_count;
+    len += bytes;
+    ++xwl->stats.virtwl_messages;
+  }
+
+  if (len)
+    xwl_virtwl_send(xwl, ioctl_send, len, fd_count);
+
+  return 1;
+}
+
+static uint32_t xwl_poll_events_to_mask(short revents) {
+  uint32_t mask = 0;
+
+  if (revents & POLLIN)
+    mask |= WL_EVENT_READABLE;
+  if (revents & POLLHUP)
+    mask |= WL_EVENT_HANGUP;
+  if (revents & POLLERR)
+    mask |= WL_EVENT_ERROR;
+
+  return mask;
+}
+
+// Handles events from the host compositor and the X server ahead of all
+// other event sources.
+static void xwl_dispatch_input(struct xwl *xwl) {
+  struct pollfd fds[3];
+  int nfds = 0;
+  uint64_t now;
+  int i;
+
+  if (xwl->virtwl_ctx_fd >= 0)
+    fds[nfds++].fd = xwl->virtwl_ctx_fd;
+  fds[nfds++].fd = wl_display_get_fd(xwl->display);
+  if (xwl->connection)
+    fds[nfds++].fd = xcb_get_file_descriptor(xwl->connection);
+  for (i = 0; i < nfds; ++i)
+    fds[i].events = POLLIN;
+
+  if (poll(fds, nfds, 0) <= 0)
+    return;
+
+  // Input could have been queued any time since the last check.
+  now = xwl_now_us();
+  if (now > xwl->input_check_time) {
+    uint64_t wait = now - xwl->input_check_time;
+
+    ++xwl->stats.input_wait_count;
+    xwl->stats.input_wait_total_us += wait;
+    xwl->stats.input_wait_max_us = MAX(xwl->stats.input_wait_max_us, wait);
+  }
+
+  for (i = 0; i < nfds; ++i) {
+    uint32_t mask = xwl_poll_events_to_mask(fds[i].revents);
+
+    if (!mask)
+      continue;
+
+    if (fds[i].fd == xwl->virtwl_ctx_fd)
+      xwl_handle_virtwl_ctx_event(fds[i].fd, mask, xwl);
+    else if (fds[i].fd == wl_display_get_fd(xwl->display))
+      xwl_handle_event(fds[i].fd, mask, xwl);
+    else
+      xwl_handle_x_connection_event(fds[i].fd, mask, xwl);
+  }
+}
+
+// Waits for and dispatches events. Input is handled first and bulk
+// transfers get a limited budget each iteration.
+static int xwl_dispatch(struct xwl *xwl, struct wl_event_loop *event_loop) {
+  struct pollfd fd = {.fd = wl_event_loop_get_fd(event_loop),
+                      .events = POLLIN};
   int rv;
+
+  wl_event_loop_dispatch_idle(event_loop);
+
+  rv = poll(&fd, 1, 0);
+  if (rv == 0) {
+    rv = poll(&fd, 1, -1);
+    // Anything that is ready now arrived while we were waiting.
+    xwl->input_check_time = xwl_now_us();
+  }
+  if (rv == -1 && errno != EINTR)
+    return -1;
+
+  xwl->bulk_budget = BULK_BUDGET_PER_DISPATCH;
+  xwl_dispatch_input(xwl);
+  xwl->input_check_time = xwl_now_us();
+
+  return wl_event_loop_dispatch(event_loop, 0);
+}
+
+static int xwl_handle_stats_timer(void *data) {
+  struct xwl *xwl = (struct xwl *)data;
+  struct xwl_stats *stats = &xwl->stats;
+
+  fprintf(stderr,
+          "stats: input wait avg %" PRIu64 "us max %" PRIu64 "us (%" PRIu64
+          " dispatches), bulk %" PRIu64 " bytes, %" PRIu64 " deferred, "
+          "virtwl %" PRIu64 " messages in %" PRIu64 " wakeups\n",
+          stats->input_wait_count
+              ? stats->input_wait_total_us / stats->input_wait_count
+              : 0,
+          stats->input_wait_max_us, stats->input_wait_count, stats->bulk_bytes,
+          stats->bulk_deferred, stats->virtwl_messages, stats->virtwl_wakeups);
+  memset(stats, 0, sizeof(*stats));
+
+  // Report startup once the first frame has reached the host.
+  if (!xwl->startup_reported && xwl->startup_milestones[STARTUP_FIRST_FRAME]) {
+    int i;
+
+    fprintf(stderr, "stats: startup");
+    for (i = 0; i < STARTUP_MILESTONE_COUNT; ++i) {
+      if (xwl->startup_milestones[i]) {
+        fprintf(stderr, " %s %" PRIu64 "ms", xwl_startup_milestone_names[i],
+                xwl->startup_milestones[i] / 1000);
+      }
+    }
+    fprintf(stderr, "\n");
+    xwl->startup_reported = 1;
+  }
+
+  wl_event_source_timer_update(xwl->stats_event_source,
+                               xwl->stats_interval * 1000);
+  return 0;
+}
+
+static int xwl_handle_buffer_trim_timer(void *data) {
+  struct xwl *xwl = (struct xwl *)data;
+  struct xwl_host_surface *host;
+  struct xwl_virtwl_pool *pool, *next;
+  uint64_t now = xwl_now_us();
+
+  // Only the tail of the list can have been idle long enough.
+  wl_list_for_each_reverse(host, &xwl->host_surfaces, link) {
+    if (now - host->last_commit_time < xwl->buffer_idle_timeout * 1000ull)
+      break;
+    xwl_host_surface_trim_buffers(host);
+  }
+
+  wl_list_for_each_safe(pool, next, &xwl->virtwl_pools, link) {
+    if (!pool->used &&
+        now - pool->empty_time >= xwl->buffer_idle_timeout * 1000ull)
+      xwl_virtwl_pool_destroy(pool);
+  }
+
+  wl_event_source_timer_update(xwl->buffer_trim_event_source,
+                               xwl->buffer_idle_timeout);
+  return 0;
+}
+
+// Parse the list of accelerators that should be reserved by the
+// compositor. Format is "|MODIFIERS|KEYSYM", where MODIFIERS is a
+// list of modifier names (E.g. <Control><Alt>) and KEYSYM is an
+// XKB key symbol name (E.g Delete).
+static int xwl_parse_accelerators(struct wl_list *accelerators,
+                                  const char *str) {
+  uint32_t modifiers = 0;
+
+  while (*str) {
+    if (*str == ',') {
+      str++;
+    } else if (*str == '<') {
+      if (strncmp(str, "<Control>", 9) == 0) {
+        modifiers |= CONTROL_MASK;
+        str += 9;
+      } else if (strncmp(str, "<Alt>", 5) == 0) {
+        modifiers |= ALT_MASK;
+        str += 5;
+      } else if (strncmp(str, "<Shift>", 7) == 0) {
+        modifiers |= SHIFT_MASK;
+        str += 7;
+      } else {
+        fprintf(stderr, "error: invalid modifier\n");
+        return -1;
+      }
+    } else {
+      struct xwl_accelerator *accelerator;
+      const char *end = strchrnul(str, ',');
+      char *name = strndup(str, end - str);
+
+      accelerator = malloc(sizeof(*accelerator));
+      assert(accelerator);
+      accelerator->modifiers = modifiers;
+      accelerator->symbol =
+          xkb_keysym_from_name(name, XKB_KEYSYM_CASE_INSENSITIVE);
+      free(name);
+      if (accelerator->symbol == XKB_KEY_NoSymbol) {
+        fprintf(stderr, "error: invalid key symbol\n");
+        free(accelerator);
+        return -1;
+      }
+
+      wl_list_insert(accelerators, &accelerator->link);
+
+      modifiers = 0;
+      str = end;
+    }
+  }
+
+  return 0;
+}
+
+static void xwl_free_accelerators(struct wl_list *accelerators) {
+  struct xwl_accelerator *accelerator, *next;
+
+  wl_list_for_each_safe(accelerator, next, accelerators, link) {
+    wl_list_remove(&accelerator->link);
+    free(accelerator);
+  }
+}
+
+// Control commands return NULL on success or a message describing why the
+// command failed.
+static const char *xwl_control_set_scale(struct xwl *xwl, const char *value) {
+  struct xwl_host_output *host;
+  struct xwl_host_surface *host_surface;
+  double scale = atof(value);
+
+  if (scale < MIN_SCALE || scale > MAX_SCALE)
+    return "invalid scale";
+  if (xwl->native_scale)
+    return "scale is chosen by native scale mode";
+
+  xwl->desired_scale = scale;
+  // Integer scale only unless wp_viewporter is available.
+  if (!xwl->viewporter)
+    scale = MIN(MAX_SCALE, MAX(MIN_SCALE, round(scale)));
+  xwl->scale = scale;
+
+  // Clients pick up the new scale through updated output state, and
+  // windows are resized so they keep their size on the host.
+  wl_list_for_each(host, &xwl->host_outputs, link)
+    xwl_send_host_output_state(host);
+  xwl_update_window_scales(xwl);
+
+  // Output buffers sized for the old scale are not reused.
+  wl_list_for_each(host_surface, &xwl->host_surfaces, link)
+    xwl_host_surface_trim_buffers(host_surface);
+
+  return NULL;
+}
+
+static const char *xwl_control_set_accelerators(struct xwl *xwl,
+                                                const char *value) {
+  struct wl_list accelerators;
+
+  wl_list_init(&accelerators);
+  if (xwl_parse_accelerators(&accelerators, value)) {
+    xwl_free_accelerators(&accelerators);
+    return "invalid accelerators";
+  }
+
+  xwl_free_accelerators(&xwl->accelerators);
+  wl_list_init(&xwl->accelerators);
+  wl_list_insert_list(&xwl->accelerators, &accelerators);
+
+  return NULL;
+}
+
+static const char *xwl_control_set_frame_color(struct xwl *xwl,
+                                               const char *value) {
+  struct xwl_window *window;
+  int r, g, b;
+
+  if (sscanf(value, "#%02x%02x%02x", &r, &g, &b) != 3)
+    return "invalid color";
+
+  xwl->frame_color = 0xff000000 | (r << 16) | (g << 8) | (b << 0);
+  xwl->has_frame_color = 1;
+
+  if (!xwl->aura_shell ||
+      xwl->aura_shell->version < ZAURA_SURFACE_SET_FRAME_COLORS_SINCE_VERSION)
+    return NULL;
+
+  wl_list_for_each(window, &xwl->windows, link) {
+    if (window->aura_surface) {
+      zaura_surface_set_frame_colors(window->aura_surface, xwl->frame_color,
+                                     xwl->frame_color);
+    }
+  }
+
+  return NULL;
+}
+
+static const char *xwl_control_set_app_id(struct xwl *xwl,
+                                          const char *value) {
+  struct xwl_window *window;
+
+  // An empty ID goes back to using the window class.
+  free(xwl->control_app_id);
+  xwl->control_app_id = *value ? strdup(value) : NULL;
+  xwl->app_id = xwl->control_app_id;
+
+  wl_list_for_each(window, &xwl->windows, link) {
+    const char *app_id = xwl->app_id ? xwl->app_id : window->clazz;
+
+    if (window->managed && window->xdg_toplevel && app_id)
+      zxdg_toplevel_v6_set_app_id(window->xdg_toplevel, app_id);
+  }
+
+  return NULL;
+}
+
+// Only copying drivers can be switched at runtime. Pools created while
+// forwarding shm directly to the host have no contents to copy from.
+static const char *xwl_control_set_shm_driver(struct xwl *xwl,
+                                              const char *value) {
+  if (xwl->shm_driver == SHM_DRIVER_NOOP)
+    return "shm driver can't be changed from noop";
+
+  if (strcmp(value, "dmabuf") == 0) {
+    if (!xwl->drm_device)
+      return "need drm device for dmabuf driver";
+    xwl->shm_driver = SHM_DRIVER_DMABUF;
+  } else if (strcmp(value, "virtwl") == 0) {
+    if (xwl->virtwl_fd == -1)
+      return "need device for virtwl driver";
+    xwl->shm_driver = SHM_DRIVER_VIRTWL;
+  } else {
+    return "unknown shm driver";
+  }
+
+  return NULL;
+}
+
+static const char *xwl_control_set_data_driver(struct xwl *xwl,
+                                               const char *value) {
+  if (strcmp(value, "noop") == 0) {
+    xwl->data_driver = DATA_DRIVER_NOOP;
+  } else if (strcmp(value, "virtwl") == 0) {
+    if (xwl->virtwl_fd == -1)
+      return "need device for virtwl driver";
+    xwl->data_driver = DATA_DRIVER_VIRTWL;
+  } else {
+    return "unknown data driver";
+  }
+
+  return NULL;
+}
+
+static void xwl_control_list_windows(struct xwl_control_client *client) {
+  struct xwl *xwl = client->xwl;
+  struct xwl_window *window;
+  struct wl_list *lists[] = {&xwl->windows, &xwl->unpaired_windows};
+  unsigned i;
+
+  for (i = 0; i < ARRAY_SIZE(lists); ++i) {
+    wl_list_for_each(window, lists[i], link) {
+      dprintf(client->fd, "window 0x%x surface %u %dx%d%+d%+d%s%s%s %s\n",
+              window->id, window->host_surface_id, window->width,
+              window->height, window->x, window->y,
+              window->managed ? " managed" : "",
+              window->realized ? " realized" : "",
+              window->unpaired ? " unpaired" : "",
+              window->name ? window->name : "");
+    }
+  }
+}
+
+static void xwl_control_list_buffers(struct xwl_control_client *client) {
+  struct xwl *xwl = client->xwl;
+  struct xwl_window *window;
+  struct xwl_virtwl_pool *pool;
+
+  dprintf(client->fd, "buffers total %zu limit %zu\n",
+          xwl->output_buffer_bytes, xwl->output_buffer_limit);
+
+  wl_list_for_each(window, &xwl->windows, link) {
+    struct wl_list *lists[2];
+    struct xwl_host_surface *host_surface;
+    struct xwl_output_buffer *buffer;
+    struct wl_resource *resource;
+    int count = 0;
+    unsigned i;
+
+    resource = wl_client_get_object(xwl->client, window->host_surface_id);
+    if (!resource)
+      continue;
+
+    host_surface = wl_resource_get_user_data(resource);
+    lists[0] = &host_surface->released_buffers;
+    lists[1] = &host_surface->busy_buffers;
+    for (i = 0; i < ARRAY_SIZE(lists); ++i) {
+      wl_list_for_each(buffer, lists[i], link) {
+        ++count;
+      }
+    }
+
+    dprintf(client->fd, "buffers 0x%x count %d bytes %zu\n", window->id,
+            count, host_surface->buffer_bytes);
+  }
+
+  wl_list_for_each(pool, &xwl->virtwl_pools, link) {
+    dprintf(client->fd, "pool size %zu used %zu\n", pool->size, pool->used);
+  }
+}
+
+static void xwl_control_print_stats(struct xwl_control_client *client) {
+  struct xwl *xwl = client->xwl;
+  struct xwl_stats *stats = &xwl->stats;
   int i;
 
-  buffer_iov.iov_base = send_data;
-  buffer_iov.iov_len = max_send_size;
+  // Counters accumulate since the last stats interval, if any.
+  dprintf(client->fd,
+          "stats input-wait %" PRIu64 "us/%" PRIu64 " max %" PRIu64
+          "us bulk %" PRIu64 " deferred %" PRIu64 " virtwl %" PRIu64
+          "/%" PRIu64 "\n",
+          stats->input_wait_total_us, stats->input_wait_count,
+          stats->input_wait_max_us, stats->bulk_bytes, stats->bulk_deferred,
+          stats->virtwl_messages, stats->virtwl_wakeups);
+  dprintf(client->fd, "scale %.3f shm-driver %d data-driver %d\n", xwl->scale,
+          xwl->shm_driver, xwl->data_driver);
+
+  for (i = 0; i < STARTUP_MILESTONE_COUNT; ++i) {
+    if (xwl->startup_milestones[i]) {
+      dprintf(client->fd, "startup %s %" PRIu64 "ms\n",
+              xwl_startup_milestone_names[i],
+              xwl->startup_milestones[i] / 1000);
+    }
+  }
+}
+
+static void xwl_control_handle_command(struct xwl_control_client *client,
+                                       char *line) {
+  struct xwl *xwl = client->xwl;
+  const char *error = NULL;
+  char *value = strchrnul(line, ' ');
+
+  if (*value)
+    *value++ = '\0';
+
+  if (strcmp(line, "scale") == 0) {
+    error = xwl_control_set_scale(xwl, value);
+  } else if (strcmp(line, "accelerators") == 0) {
+    error = xwl_control_set_accelerators(xwl, value);
+  } else if (strcmp(line, "frame-color") == 0) {
+    error = xwl_control_set_frame_color(xwl, value);
+  } else if (strcmp(line, "app-id") == 0) {
+    error = xwl_control_set_app_id(xwl, value);
+  } else if (strcmp(line, "shm-driver") == 0) {
+    error = xwl_control_set_shm_driver(xwl, value);
+  } else if (strcmp(line, "data-driver") == 0) {
+    error = xwl_control_set_data_driver(xwl, value);
+  } else if (strcmp(line, "windows") == 0) {
+    xwl_control_list_windows(client);
+  } else if (strcmp(line, "buffers") == 0) {
+    xwl_control_list_buffers(client);
+  } else if (strcmp(line, "stats") == 0) {
+    xwl_control_print_stats(client);
+  } else {
+    error = "unknown command";
+  }
+
+  if (error)
+    dprintf(client->fd, "error: %s\n", error);
+  else
+    dprintf(client->fd, "ok\n");
 
-  msg.msg_iov = &buffer_iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = fd_buffer;
-  msg.msg_controllen = sizeof(fd_buffer);
+  wl_display_flush_clients(xwl->host_display);
+  wl_display_flush(xwl->display);
+}
 
-  bytes = recvmsg(xwl->virtwl_socket_fd, &msg, 0);
-  assert(bytes > 0);
+static void xwl_control_client_destroy(struct xwl_control_client *client) {
+  wl_event_source_remove(client->event_source);
+  close(client->fd);
+  free(client);
+}
 
-  // If there were any FDs recv'd by recvmsg, there will be some data in the
-  // msg_control buffer. To get the FDs out we iterate all cmsghdr's within and
-  // unpack the FDs if the cmsghdr type is SCM_RIGHTS.
-  for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
-       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-    size_t cmsg_fd_count;
+static int xwl_handle_control_client_event(int fd, uint32_t mask,
+                                           void *data) {
+  struct xwl_control_client *client = (struct xwl_control_client *)data;
+  char *line, *end;
+  ssize_t bytes;
 
-    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
-      continue;
+  bytes = read(fd, client->buffer + client->length,
+               sizeof(client->buffer) - client->length);
+  if (bytes < 0 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+  if (bytes <= 0) {
+    xwl_control_client_destroy(client);
+    return 0;
+  }
+  client->length += bytes;
+
+  // Commands are newline terminated.
+  line = client->buffer;
+  while ((end = memchr(line, '\n', client->buffer + client->length - line))) {
+    *end = '\0';
+    if (end > line && end[-1] == '\r')
+      end[-1] = '\0';
+    if (*line)
+      xwl_control_handle_command(client, line);
+    line = end + 1;
+  }
 
-    cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  client->length -= line - client->buffer;
+  memmove(client->buffer, line, client->length);
 
-    // fd_count will never exceed VIRTWL_SEND_MAX_ALLOCS because the
-    // control message buffer only allocates enough space for that many FDs.
-    memcpy(&ioctl_send->fds[fd_count], CMSG_DATA(cmsg),
-           cmsg_fd_count * sizeof(int));
-    fd_count += cmsg_fd_count;
+  if (client->length == sizeof(client->buffer)) {
+    dprintf(client->fd, "error: command too long\n");
+    xwl_control_client_destroy(client);
   }
 
-  for (i = fd_count; i < VIRTWL_SEND_MAX_ALLOCS; ++i)
-    ioctl_send->fds[i] = -1;
+  return 0;
+}
 
-  // The FDs and data were extracted from the recvmsg call into the ioctl_send
-  // structure which we now pass along to the kernel.
-  ioctl_send->len = bytes;
-  rv = ioctl(xwl->virtwl_ctx_fd, VIRTWL_IOCTL_SEND, ioctl_send);
-  assert(!rv);
+static int xwl_handle_control_connection(int fd, uint32_t mask, void *data) {
+  struct xwl *xwl = (struct xwl *)data;
+  struct xwl_control_client *client;
+  int client_fd;
 
-  while (fd_count--)
-    close(ioctl_send->fds[fd_count]);
+  // Non-blocking so that a client that stops reading can't stall the
+  // compositor. Replies that don't fit in the socket buffer are dropped.
+  client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (client_fd < 0)
+    return 0;
+
+  client = malloc(sizeof(*client));
+  assert(client);
+  client->xwl = xwl;
+  client->fd = client_fd;
+  client->length = 0;
+  client->event_source = wl_event_loop_add_fd(
+      wl_display_get_event_loop(xwl->host_display), client_fd,
+      WL_EVENT_READABLE, xwl_handle_control_client_event, client);
 
   return 1;
 }
@@ -6556,27 +9512,162 @@ static int xwl_parse_cmd_prefix(char *str, int argc, char **argv) {
   return n;
 }
 
+// Executes a new sommelier process serving a master connection. |fd_arg| is
+// either a --client-fd or a --worker-fd argument.
+static void xwl_exec_peer(int argc, char **argv, const char *peer_cmd_prefix,
+                          char *peer_pid_arg, char *fd_arg) {
+  char peer_cmd_prefix_str[1024];
+  char *args[64];
+  int i = 0, j;
+
+  if (peer_cmd_prefix) {
+    snprintf(peer_cmd_prefix_str, sizeof(peer_cmd_prefix_str), "%s",
+             peer_cmd_prefix);
+
+    i = xwl_parse_cmd_prefix(peer_cmd_prefix_str, 32, args);
+    if (i > 32) {
+      fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
+      i = 0;
+    }
+  }
+
+  args[i++] = argv[0];
+  if (peer_pid_arg)
+    args[i++] = peer_pid_arg;
+  args[i++] = fd_arg;
+
+  // forward some flags.
+  for (j = 1; j < argc; ++j) {
+    char *arg = argv[j];
+    if (strstr(arg, "--display") == arg ||
+        strstr(arg, "--scale") == arg ||
+        strstr(arg, "--native-scale") == arg ||
+        strstr(arg, "--accelerators") == arg ||
+        strstr(arg, "--keymap-cache") == arg ||
+        strstr(arg, "--virtwl-device") == arg ||
+        strstr(arg, "--virtwl-buffer-size") == arg ||
+        strstr(arg, "--virtwl-pool-limit") == arg ||
+        strstr(arg, "--buffer-idle-timeout") == arg ||
+        strstr(arg, "--buffer-limit") == arg ||
+        strstr(arg, "--drm-device") == arg ||
+        strstr(arg, "--shm-driver") == arg ||
+        strstr(arg, "--data-driver") == arg ||
+        strstr(arg, "--stats-interval") == arg ||
+        strstr(arg, "--trace-startup") == arg) {
+      args[i++] = arg;
+    }
+  }
+
+  args[i++] = NULL;
+
+  execvp(args[0], args);
+  _exit(EXIT_FAILURE);
+}
+
+// Starts a worker that connects to the host and then waits for a client
+// from the master. Returns the master end of the worker socket.
+static int xwl_spawn_worker(int argc, char **argv, const char *peer_cmd_prefix,
+                            int sock_fd, int lock_fd) {
+  int ws[2];
+  pid_t pid;
+  int rv;
+
+  rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ws);
+  assert(!rv);
+
+  pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    char worker_fd_str[64];
+
+    close(sock_fd);
+    close(lock_fd);
+
+    snprintf(worker_fd_str, sizeof(worker_fd_str), "--worker-fd=%d",
+             dup(ws[1]));
+    xwl_exec_peer(argc, argv, peer_cmd_prefix, NULL, worker_fd_str);
+  }
+  close(ws[1]);
+
+  return ws[0];
+}
+
+// Hands |client_fd| to an idle worker. Workers are used in the order they
+// were started, as the oldest one is the most likely to have finished
+// connecting to the host. New workers are appended. Returns 1 on success,
+// or 0 if no live worker was available.
+static int xwl_handoff_to_worker(int *worker_fds, int *worker_count,
+                                 int client_fd, pid_t peer_pid) {
+  char fd_buffer[CMSG_LEN(sizeof(int))];
+  struct iovec iov = {.iov_base = &peer_pid, .iov_len = sizeof(peer_pid)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = fd_buffer,
+                       .msg_controllen = sizeof(fd_buffer)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  ssize_t bytes;
+
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &client_fd, sizeof(int));
+
+  while (*worker_count) {
+    int worker_fd = worker_fds[0];
+
+    --*worker_count;
+    memmove(worker_fds, worker_fds + 1, *worker_count * sizeof(*worker_fds));
+
+    // Workers that died while idle fail with EPIPE and are skipped.
+    bytes = sendmsg(worker_fd, &msg, MSG_NOSIGNAL);
+    close(worker_fd);
+    if (bytes == sizeof(peer_pid))
+      return 1;
+  }
+
+  return 0;
+}
+
 static void xwl_print_usage() {
   printf("usage: sommelier [options] [program] [args...]\n\n"
          "options:\n"
          "  -h, --help\t\t\tPrint this help\n"
          "  -X\t\t\t\tEnable X11 forwarding\n"
          "  --master\t\t\tRun as master and spawn child processes\n"
+         "  --single-process\t\tServe all master clients from one process\n"
+         "  --worker-pool-size=SIZE\tNumber of pre-started master workers\n"
          "  --socket=SOCKET\t\tName of socket to listen on\n"
          "  --display=DISPLAY\t\tWayland display to connect to\n"
          "  --shm-driver=DRIVER\t\tSHM driver to use (noop, dmabuf, virtwl)\n"
          "  --data-driver=DRIVER\t\tData driver to use (noop, virtwl)\n"
          "  --scale=SCALE\t\t\tScale factor for contents\n"
+         "  --native-scale\t\tMatch X11 pixels to host display pixels\n"
          "  --peer-cmd-prefix=PREFIX\tPeer process command line prefix\n"
          "  --accelerators=ACCELERATORS\tList of keyboard accelerators\n"
+         "  --keymap-cache=PATH\t\tFile for sharing keymaps with workers\n"
          "  --app-id=ID\t\t\tForced application ID for X11 clients\n"
          "  --x-display=DISPLAY\t\tX11 display to listen on\n"
          "  --xwayland-path=PATH\t\tPath to Xwayland executable\n"
+         "  --xwayland-lazy\t\tStart Xwayland on first X client connection\n"
          "  --xwayland-cmd-prefix=PREFIX\tXwayland command line prefix\n"
          "  --no-exit-with-child\t\tKeep process alive after child exists\n"
          "  --no-clipboard-manager\tDisable X11 clipboard manager\n"
+         "  --clipboard-prefetch-size=BYTES\n"
+         "\t\t\t\tPrefetch clipboard text up to size\n"
+         "  --clipboard-prefetch-timeout=MS\n"
+         "\t\t\t\tCancel idle clipboard prefetch after timeout\n"
          "  --frame-color=COLOR\t\tWindow frame color for X11 clients\n"
+         "  --configure-pacing\t\tLimit X11 window configures to frame rate\n"
+         "  --stats-interval=SECONDS\tPrint statistics at interval\n"
+         "  --control-socket=PATH\t\tAccept runtime commands on socket\n"
+         "  --trace-startup\t\tPrint startup milestones as reached\n"
+         "  --startup-status\t\tReport startup milestones to systemd\n"
          "  --virtwl-device=DEVICE\tVirtWL device to use\n"
+         "  --virtwl-buffer-size=BYTES\tVirtWL transaction buffer size\n"
+         "  --virtwl-pool-limit=BYTES\tPool VirtWL output buffers up to limit\n"
+         "  --buffer-idle-timeout=MS\tFree idle surface buffers after "
+         "timeout\n"
+         "  --buffer-limit=BYTES\t\tLimit on memory used by output buffers\n"
          "  --drm-device=DEVICE\t\tDRM device to use\n"
          "  --glamor\t\t\tUse glamor to accelerate X11 clients\n");
 }
@@ -6608,12 +9699,27 @@ int main(int argc, char **argv) {
       .virtwl_socket_fd = -1,
       .virtwl_ctx_event_source = NULL,
       .virtwl_socket_event_source = NULL,
+      .virtwl_buffer_size = VIRTWL_DEFAULT_BUFFER_SIZE,
+      .virtwl_recv_buffer = NULL,
+      .virtwl_send_buffer = NULL,
+      .virtwl_pool_size = 0,
+      .virtwl_pool_limit = VIRTWL_POOL_DEFAULT_LIMIT,
+      .output_buffer_bytes = 0,
+      .output_buffer_limit = 0,
+      .buffer_idle_timeout = OUTPUT_BUFFER_DEFAULT_IDLE_TIMEOUT,
+      .buffer_trim_event_source = NULL,
       .drm_device = NULL,
       .gbm = NULL,
       .xwayland = 0,
       .xwayland_pid = -1,
       .child_pid = -1,
+      .child_ready_fd = -1,
       .peer_pid = -1,
+      .worker_fd = -1,
+      .worker_event_source = NULL,
+      .client_destroy_listener = {.notify = xwl_client_destroy_notify},
+      .pending_client_fd = -1,
+      .registry_complete = 0,
       .xkb_context = NULL,
       .next_global_id = 1,
       .connection = NULL,
@@ -6625,18 +9731,30 @@ int main(int argc, char **argv) {
       .needs_set_input_focus = 0,
       .desired_scale = 1.0,
       .scale = 1.0,
+      .native_scale = 0,
       .app_id = NULL,
+      .keymap_cache = NULL,
+      .control_app_id = NULL,
       .exit_with_child = 1,
       .sd_notify = NULL,
       .clipboard_manager = 0,
       .frame_color = 0,
       .has_frame_color = 0,
       .show_window_title = 0,
+      .configure_pacing = 0,
+      .bulk_budget = BULK_BUDGET_PER_DISPATCH,
+      .input_check_time = 0,
+      .stats_interval = 0,
+      .startup_time = 0,
+      .startup_reported = 0,
+      .trace_startup = 0,
+      .startup_status = 0,
+      .stats_event_source = NULL,
+      .stats = {0},
       .default_seat = NULL,
       .selection_window = XCB_WINDOW_NONE,
       .selection_owner = XCB_WINDOW_NONE,
       .selection_incremental_transfer = 0,
-      .selection_request = {.requestor = XCB_NONE, .property = XCB_ATOM_NONE},
       .selection_timestamp = XCB_CURRENT_TIME,
       .selection_data_device = NULL,
       .selection_data_offer = NULL,
@@ -6645,9 +9763,19 @@ int main(int argc, char **argv) {
       .selection_send_event_source = NULL,
       .selection_property_reply = NULL,
       .selection_property_offset = 0,
+      .selection_property_long_offset = 0,
+      .selection_property_fetch_pending = 0,
       .selection_event_source = NULL,
+      .selection_data_base = 0,
       .selection_data_offer_receive_fd = -1,
-      .selection_data_ack_pending = 0,
+      .selection_cache_offer = NULL,
+      .selection_cache_mime_type = 0,
+      .selection_transfer_event_source = NULL,
+      .selection_max_chunk_size = 0,
+      .clipboard_prefetch_size = 0,
+      .clipboard_prefetch_timeout = CLIPBOARD_PREFETCH_DEFAULT_TIMEOUT_MS,
+      .selection_prefetching = 0,
+      .selection_prefetch_event_source = NULL,
       .atoms =
           {
                   [ATOM_WM_S0] = {"WM_S0"},
@@ -6674,6 +9802,9 @@ int main(int argc, char **argv) {
                   [ATOM_CLIPBOARD_MANAGER] = {"CLIPBOARD_MANAGER"},
                   [ATOM_TARGETS] = {"TARGETS"},
                   [ATOM_TIMESTAMP] = {"TIMESTAMP"}, [ATOM_TEXT] = {"TEXT"},
+                  [ATOM_TEXT_HTML] = {"text/html"},
+                  [ATOM_TEXT_URI_LIST] = {"text/uri-list"},
+                  [ATOM_IMAGE_PNG] = {"image/png"},
                   [ATOM_INCR] = {"INCR"},
                   [ATOM_WL_SELECTION] = {"_WL_SELECTION"},
           },
@@ -6682,9 +9813,21 @@ int main(int argc, char **argv) {
   const char *display = getenv("SOMMELIER_DISPLAY");
   const char *scale = getenv("SOMMELIER_SCALE");
   const char *clipboard_manager = getenv("SOMMELIER_CLIPBOARD_MANAGER");
+  const char *clipboard_prefetch_size =
+      getenv("SOMMELIER_CLIPBOARD_PREFETCH_SIZE");
+  const char *clipboard_prefetch_timeout =
+      getenv("SOMMELIER_CLIPBOARD_PREFETCH_TIMEOUT");
   const char *frame_color = getenv("SOMMELIER_FRAME_COLOR");
   const char *show_window_title = getenv("SOMMELIER_SHOW_WINDOW_TITLE");
+  const char *configure_pacing = getenv("SOMMELIER_CONFIGURE_PACING");
+  const char *stats_interval = getenv("SOMMELIER_STATS_INTERVAL");
+  const char *trace_startup = getenv("SOMMELIER_TRACE_STARTUP");
+  const char *startup_status = getenv("SOMMELIER_STARTUP_STATUS");
   const char *virtwl_device = getenv("SOMMELIER_VIRTWL_DEVICE");
+  const char *virtwl_buffer_size = getenv("SOMMELIER_VIRTWL_BUFFER_SIZE");
+  const char *virtwl_pool_limit = getenv("SOMMELIER_VIRTWL_POOL_LIMIT");
+  const char *buffer_idle_timeout = getenv("SOMMELIER_BUFFER_IDLE_TIMEOUT");
+  const char *buffer_limit = getenv("SOMMELIER_BUFFER_LIMIT");
   const char *drm_device = getenv("SOMMELIER_DRM_DEVICE");
   const char *glamor = getenv("SOMMELIER_GLAMOR");
   const char *shm_driver = getenv("SOMMELIER_SHM_DRIVER");
@@ -6693,20 +9836,28 @@ int main(int argc, char **argv) {
   const char *xwayland_cmd_prefix = getenv("SOMMELIER_XWAYLAND_CMD_PREFIX");
   const char *accelerators = getenv("SOMMELIER_ACCELERATORS");
   const char *xwayland_path = getenv("SOMMELIER_XWAYLAND_PATH");
+  const char *xwayland_lazy = getenv("SOMMELIER_XWAYLAND_LAZY");
+  const char *worker_pool_size = getenv("SOMMELIER_WORKER_POOL_SIZE");
+  const char *control_socket = getenv("SOMMELIER_CONTROL_SOCKET");
+  const char *native_scale = getenv("SOMMELIER_NATIVE_SCALE");
+  const char *keymap_cache = getenv("SOMMELIER_KEYMAP_CACHE");
+  char keymap_cache_path[PATH_MAX];
   const char *socket_name = "wayland-0";
   const char *runtime_dir;
   struct wl_event_loop *event_loop;
-  struct wl_listener client_destroy_listener = {.notify =
-                                                    xwl_client_destroy_notify};
   int sv[2];
   pid_t pid;
   int virtwl_display_fd = -1;
   int xdisplay = -1;
   int master = 0;
+  int single_process = 0;
+  int master_fd = -1;
   int client_fd = -1;
   int rv;
   int i;
 
+  xwl.startup_time = xwl_now_us();
+
   for (i = 1; i < argc; ++i) {
     const char *arg = argv[i];
     if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0 ||
@@ -6720,6 +9871,16 @@ int main(int argc, char **argv) {
     }
     if (strstr(arg, "--master") == arg) {
       master = 1;
+    } else if (strstr(arg, "--single-process") == arg) {
+      single_process = 1;
+    } else if (strstr(arg, "--worker-pool-size") == arg) {
+      const char *s = strchr(arg, '=');
+      ++s;
+      worker_pool_size = s;
+    } else if (strstr(arg, "--worker-fd") == arg) {
+      const char *s = strchr(arg, '=');
+      ++s;
+      xwl.worker_fd = atoi(s);
     } else if (strstr(arg, "--socket") == arg) {
       const char *s = strchr(arg, '=');
       ++s;
@@ -6740,6 +9901,12 @@ int main(int argc, char **argv) {
       const char *s = strchr(arg, '=');
       ++s;
       xwl.peer_pid = atoi(s);
+    } else if (strstr(arg, "--native-scale") == arg) {
+      native_scale = "1";
+    } else if (strstr(arg, "--keymap-cache") == arg) {
+      const char *s = strchr(arg, '=');
+      ++s;
+      keymap_cache = s;
     } else if (strstr(arg, "--peer-cmd-prefix") == arg) {
       const char *s = strchr(arg, '=');
       ++s;
@@ -6776,6 +9943,8 @@ int main(int argc, char **argv) {
       const char *s = strchr(arg, '=');
       ++s;
       xwayland_path = s;
+    } else if (strstr(arg, "--xwayland-lazy") == arg) {
+      xwayland_lazy = "1";
     } else if (strstr(arg, "--no-exit-with-child") == arg) {
       xwl.exit_with_child = 0;
     } else if (strstr(arg, "--sd-notify") == arg) {
@@ -6784,16 +9953,54 @@ int main(int argc, char **argv) {
       xwl.sd_notify = s;
     } else if (strstr(arg, "--no-clipboard-manager") == arg) {
       clipboard_manager = "0";
+    } else if (strstr(arg, "--clipboard-prefetch-size") == arg) {
+      const char *s = strchr(arg, '=');
+      ++s;
+      clipboard_prefetch_size = s;
+    } else if (strstr(arg, "--clipboard-prefetch-timeout") == arg) {
+      const char *s = strchr(arg, '=');
+      ++s;
+      clipboard_prefetch_timeout = s;
     } else if (strstr(arg, "--frame-color") == arg) {
       const char *s = strchr(arg, '=');
       ++s;
       frame_color = s;
     } else if (strstr(arg, "--show-window-title") == arg) {
       show_window_title = "1";
+    } else if (strstr(arg, "--configure-pacing") == arg) {
+      configure_pacing = "1";
+    } else if (strstr(arg, "--trace-startup") == arg) {
+      trace_startup = "1";
+    } else if (strstr(arg, "--startup-status") == arg) {
+      startup_status = "1";
+    } else if (strstr(arg, "--control-socket") == arg) {
+      const char *s = strchr(arg, '=');
+      ++s;
+      control_socket = s;
+    } else if (strstr(arg, "--stats-interval") == arg) {
+      const char *s = strchr(arg, '=');
+      ++s;
+      stats_interval = s;
     } else if (strstr(arg, "--virtwl-device") == arg) {
       const char *s = strchr(arg, '=');
       ++s;
       virtwl_device = s;
+    } else if (strstr(arg, "--virtwl-buffer-size") == arg) {
+      const char *s = strchr(arg, '=');
+      ++s;
+      virtwl_buffer_size = s;
+    } else if (strstr(arg, "--virtwl-pool-limit") == arg) {
+      const char *s = strchr(arg, '=');
+      ++s;
+      virtwl_pool_limit = s;
+    } else if (strstr(arg, "--buffer-idle-timeout") == arg) {
+      const char *s = strchr(arg, '=');
+      ++s;
+      buffer_idle_timeout = s;
+    } else if (strstr(arg, "--buffer-limit") == arg) {
+      const char *s = strchr(arg, '=');
+      ++s;
+      buffer_limit = s;
     } else if (strstr(arg, "--drm-device") == arg) {
       const char *s = strchr(arg, '=');
       ++s;
@@ -6824,6 +10031,9 @@ int main(int argc, char **argv) {
     struct sockaddr_un addr;
     struct sigaction sa;
     struct stat sock_stat;
+    int worker_fds[MAX_WORKER_POOL_SIZE];
+    int worker_count = 0;
+    int worker_pool_max = 0;
     int lock_fd;
     int sock_fd;
 
@@ -6869,10 +10079,21 @@ int main(int argc, char **argv) {
     rv = sigaction(SIGCHLD, &sa, NULL);
     assert(rv >= 0);
 
+    if (worker_pool_size && !single_process) {
+      worker_pool_max =
+          MIN(MAX_WORKER_POOL_SIZE, MAX(0, atoi(worker_pool_size)));
+    }
+    while (worker_count < worker_pool_max) {
+      worker_fds[worker_count++] =
+          xwl_spawn_worker(argc, argv, peer_cmd_prefix, sock_fd, lock_fd);
+    }
+
     if (xwl.sd_notify)
       xwl_sd_notify(xwl.sd_notify);
 
-    do {
+    // In single process mode, connections are accepted by the event loop
+    // once the host connection has been established.
+    while (!single_process) {
       struct ucred ucred;
       socklen_t length = sizeof(addr);
 
@@ -6886,62 +10107,40 @@ int main(int argc, char **argv) {
       length = sizeof(ucred);
       rv = getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &ucred, &length);
 
+      if (xwl_handoff_to_worker(worker_fds, &worker_count, client_fd,
+                                ucred.pid)) {
+        close(client_fd);
+
+        // Replace the worker that took this connection.
+        while (worker_count < worker_pool_max) {
+          worker_fds[worker_count++] = xwl_spawn_worker(
+              argc, argv, peer_cmd_prefix, sock_fd, lock_fd);
+        }
+        continue;
+      }
+
       pid = fork();
       assert(pid != -1);
       if (pid == 0) {
         char client_fd_str[64], peer_pid_str[64];
-        char peer_cmd_prefix_str[1024];
-        char *args[64];
-        int i = 0, j;
 
         close(sock_fd);
         close(lock_fd);
 
-        if (peer_cmd_prefix) {
-          snprintf(peer_cmd_prefix_str, sizeof(peer_cmd_prefix_str), "%s",
-                   peer_cmd_prefix);
-
-          i = xwl_parse_cmd_prefix(peer_cmd_prefix_str, 32, args);
-          if (i > 32) {
-            fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
-            i = 0;
-          }
-        }
-
-        args[i++] = argv[0];
         snprintf(peer_pid_str, sizeof(peer_pid_str), "--peer-pid=%d",
                  ucred.pid);
-        args[i++] = peer_pid_str;
         snprintf(client_fd_str, sizeof(client_fd_str), "--client-fd=%d",
                  client_fd);
-        args[i++] = client_fd_str;
-
-        // forward some flags.
-        for (j = 1; j < argc; ++j) {
-          char *arg = argv[j];
-          if (strstr(arg, "--display") == arg ||
-              strstr(arg, "--scale") == arg ||
-              strstr(arg, "--accelerators") == arg ||
-              strstr(arg, "--virtwl-device") == arg ||
-              strstr(arg, "--drm-device") == arg ||
-              strstr(arg, "--shm-driver") == arg ||
-              strstr(arg, "--data-driver") == arg) {
-            args[i++] = arg;
-          }
-        }
-
-        args[i++] = NULL;
-
-        execvp(args[0], args);
-        _exit(EXIT_FAILURE);
+        xwl_exec_peer(argc, argv, peer_cmd_prefix, peer_pid_str,
+                      client_fd_str);
       }
       close(client_fd);
-    } while (1);
+    }
 
-    _exit(EXIT_FAILURE);
+    master_fd = sock_fd;
   }
 
-  if (client_fd == -1) {
+  if (client_fd == -1 && master_fd == -1 && xwl.worker_fd == -1) {
     if (!xwl.runprog || !xwl.runprog[0]) {
       xwl_print_usage();
       return EXIT_FAILURE;
@@ -6954,6 +10153,14 @@ int main(int argc, char **argv) {
     xwl.clipboard_manager = 1;
     if (clipboard_manager)
       xwl.clipboard_manager = !!strcmp(clipboard_manager, "0");
+
+    if (clipboard_prefetch_size)
+      xwl.clipboard_prefetch_size = MIN(
+          SELECTION_CACHE_MAX_SIZE, MAX(0, atoi(clipboard_prefetch_size)));
+    if (clipboard_prefetch_timeout) {
+      xwl.clipboard_prefetch_timeout =
+          MAX(1, atoi(clipboard_prefetch_timeout));
+    }
   }
 
   if (scale) {
@@ -6962,6 +10169,9 @@ int main(int argc, char **argv) {
     xwl.scale = MIN(MAX_SCALE, MAX(MIN_SCALE, round(xwl.desired_scale)));
   }
 
+  if (native_scale)
+    xwl.native_scale = !!strcmp(native_scale, "0");
+
   if (frame_color) {
     int r, g, b;
     if (sscanf(frame_color, "#%02x%02x%02x", &r, &g, &b) == 3) {
@@ -6973,6 +10183,19 @@ int main(int argc, char **argv) {
   if (show_window_title)
     xwl.show_window_title = !!strcmp(show_window_title, "0");
 
+  if (configure_pacing)
+    xwl.configure_pacing = !!strcmp(configure_pacing, "0");
+
+  if (stats_interval)
+    xwl.stats_interval = MAX(0, atoi(stats_interval));
+
+  if (trace_startup)
+    xwl.trace_startup = !!strcmp(trace_startup, "0");
+
+  // Status lines need a systemd notification socket.
+  if (startup_status && getenv("NOTIFY_SOCKET"))
+    xwl.startup_status = !!strcmp(startup_status, "0");
+
   // Handle broken pipes without signals that kill the entire process.
   signal(SIGPIPE, SIG_IGN);
 
@@ -6999,6 +10222,7 @@ int main(int argc, char **argv) {
     // wl_display_roundtrip will cause a deadlock.
     if (!display) {
       int vws[2];
+      int flags;
 
       // Connection to virtwl channel.
       rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, vws);
@@ -7012,6 +10236,23 @@ int main(int argc, char **argv) {
 
       xwl.virtwl_ctx_fd = new_ctx.fd;
 
+      if (virtwl_buffer_size) {
+        xwl.virtwl_buffer_size =
+            MIN(VIRTWL_MAX_BUFFER_SIZE,
+                MAX(VIRTWL_DEFAULT_BUFFER_SIZE, atoi(virtwl_buffer_size)));
+      }
+      if (xwl.virtwl_buffer_size > VIRTWL_DEFAULT_BUFFER_SIZE) {
+        xwl.virtwl_recv_buffer = malloc(xwl.virtwl_buffer_size);
+        assert(xwl.virtwl_recv_buffer);
+        xwl.virtwl_send_buffer = malloc(xwl.virtwl_buffer_size);
+        assert(xwl.virtwl_send_buffer);
+      }
+
+      // Allows draining the context without blocking.
+      flags = fcntl(xwl.virtwl_ctx_fd, F_GETFL, 0);
+      rv = fcntl(xwl.virtwl_ctx_fd, F_SETFL, flags | O_NONBLOCK);
+      assert(!rv);
+
       xwl.virtwl_socket_event_source = wl_event_loop_add_fd(
           event_loop, xwl.virtwl_socket_fd, WL_EVENT_READABLE,
           xwl_handle_virtwl_socket_event, &xwl);
@@ -7058,6 +10299,15 @@ int main(int argc, char **argv) {
     xwl.shm_driver = SHM_DRIVER_VIRTWL;
   }
 
+  if (virtwl_pool_limit)
+    xwl.virtwl_pool_limit = strtoul(virtwl_pool_limit, NULL, 10);
+
+  if (buffer_idle_timeout)
+    xwl.buffer_idle_timeout = MAX(0, atoi(buffer_idle_timeout));
+
+  if (buffer_limit)
+    xwl.output_buffer_limit = strtoul(buffer_limit, NULL, 10);
+
   if (data_driver) {
     if (strcmp(data_driver, "virtwl") == 0) {
       if (xwl.virtwl_fd == -1) {
@@ -7076,101 +10326,59 @@ int main(int argc, char **argv) {
     assert(!rv);
 
     client_fd = sv[0];
-  }
-
-  xwl.xkb_context = xkb_context_new(0);
-  assert(xwl.xkb_context);
 
-  if (virtwl_display_fd != -1) {
-    xwl.display = wl_display_connect_to_fd(virtwl_display_fd);
-  } else {
-    if (display == NULL)
-      display = getenv("WAYLAND_DISPLAY");
-    if (display == NULL)
-      display = "wayland-0";
+    // Programs are started before connecting to the host so that their
+    // startup overlaps with host registry discovery.
+    xwl.sigchld_event_source =
+        wl_event_loop_add_signal(event_loop, SIGCHLD, xwl_handle_sigchld, &xwl);
 
-    xwl.display = wl_display_connect(display);
-  }
+    if (xwl.xwayland) {
+      int x_listen_fd = -1;
+      int ds[2], wm[2], cp[2];
 
-  if (!xwl.display) {
-    fprintf(stderr, "error: failed to connect to %s\n", display);
-    return EXIT_FAILURE;
-  }
+      // Start the program ahead of time so that only exec remains once the
+      // X display is ready.
+      rv = pipe2(cp, O_CLOEXEC);
+      assert(!rv);
 
-  wl_list_init(&xwl.accelerators);
-  wl_list_init(&xwl.registries);
-  wl_list_init(&xwl.globals);
-  wl_list_init(&xwl.outputs);
-  wl_list_init(&xwl.seats);
-  wl_list_init(&xwl.windows);
-  wl_list_init(&xwl.unpaired_windows);
+      pid = fork();
+      assert(pid != -1);
+      if (pid == 0) {
+        char display_name[16];
+        ssize_t bytes;
 
-  // Parse the list of accelerators that should be reserved by the
-  // compositor. Format is "|MODIFIERS|KEYSYM", where MODIFIERS is a
-  // list of modifier names (E.g. <Control><Alt>) and KEYSYM is an
-  // XKB key symbol name (E.g Delete).
-  if (accelerators) {
-    uint32_t modifiers = 0;
-
-    while (*accelerators) {
-      if (*accelerators == ',') {
-        accelerators++;
-      } else if (*accelerators == '<') {
-        if (strncmp(accelerators, "<Control>", 9) == 0) {
-          modifiers |= CONTROL_MASK;
-          accelerators += 9;
-        } else if (strncmp(accelerators, "<Alt>", 5) == 0) {
-          modifiers |= ALT_MASK;
-          accelerators += 5;
-        } else if (strncmp(accelerators, "<Shift>", 7) == 0) {
-          modifiers |= SHIFT_MASK;
-          accelerators += 7;
-        } else {
-          fprintf(stderr, "error: invalid modifier\n");
-          return EXIT_FAILURE;
-        }
-      } else {
-        struct xwl_accelerator *accelerator;
-        const char *end = strchrnul(accelerators, ',');
-        char *name = strndup(accelerators, end - accelerators);
-
-        accelerator = malloc(sizeof(*accelerator));
-        accelerator->modifiers = modifiers;
-        accelerator->symbol =
-            xkb_keysym_from_name(name, XKB_KEYSYM_CASE_INSENSITIVE);
-        if (accelerator->symbol == XKB_KEY_NoSymbol) {
-          fprintf(stderr, "error: invalid key symbol\n");
-          return EXIT_FAILURE;
-        }
+        close(sv[0]);
+        close(sv[1]);
+        close(cp[1]);
 
-        wl_list_insert(&xwl.accelerators, &accelerator->link);
+        bytes = read(cp[0], display_name, sizeof(display_name) - 1);
+        if (bytes <= 0)
+          _exit(EXIT_FAILURE);
+        display_name[bytes] = '\0';
+        setenv("DISPLAY", display_name, 1);
 
-        modifiers = 0;
-        accelerators = end;
-        free(name);
+        xwl_execvp(xwl.runprog[0], xwl.runprog, -1);
+        _exit(EXIT_FAILURE);
       }
-    }
-  }
-
-  xwl.display_event_source =
-      wl_event_loop_add_fd(event_loop, wl_display_get_fd(xwl.display),
-                           WL_EVENT_READABLE, xwl_handle_event, &xwl);
-
-  wl_registry_add_listener(wl_display_get_registry(xwl.display),
-                           &xwl_registry_listener, &xwl);
-
-  xwl.client = wl_client_create(xwl.host_display, client_fd);
+      close(cp[0]);
+      xwl.child_pid = pid;
+      xwl.child_ready_fd = cp[1];
 
-  // Replace the core display implementation. This is needed in order to
-  // implement sync handler properly.
-  wl_client_for_each_resource(xwl.client, xwl_set_display_implementation, &xwl);
+      // With lazy startup, the display is known up front and Xwayland is
+      // started when the first X client connects.
+      if (xwayland_lazy && strcmp(xwayland_lazy, "0")) {
+        char display_name[16];
 
-  if (xwl.runprog || xwl.xwayland) {
-    xwl.sigchld_event_source =
-        wl_event_loop_add_signal(event_loop, SIGCHLD, xwl_handle_sigchld, &xwl);
+        x_listen_fd = xwl_open_x_display(&xdisplay);
+        if (x_listen_fd < 0) {
+          fprintf(stderr, "error: unable to listen on X display\n");
+          return EXIT_FAILURE;
+        }
 
-    if (xwl.xwayland) {
-      int ds[2], wm[2];
+        snprintf(display_name, sizeof(display_name), ":%d", xdisplay);
+        setenv("DISPLAY", display_name, 1);
+        xwl_start_child(&xwl, display_name);
+      }
 
       // Xwayland display ready socket.
       rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ds);
@@ -7190,6 +10398,7 @@ int main(int argc, char **argv) {
       assert(pid != -1);
       if (pid == 0) {
         char display_str[8], display_fd_str[8], wm_fd_str[8];
+        char listen_fd_str[8];
         char xwayland_path_str[1024];
         char xwayland_cmd_prefix_str[1024];
         char *args[64];
@@ -7216,12 +10425,25 @@ int main(int argc, char **argv) {
         fd = dup(wm[1]);
         snprintf(wm_fd_str, sizeof(wm_fd_str), "%d", fd);
 
-        if (xdisplay > 0) {
+        if (xdisplay > 0 || x_listen_fd >= 0) {
           snprintf(display_str, sizeof(display_str), ":%d", xdisplay);
           args[i++] = display_str;
         }
         args[i++] = "-nolisten";
         args[i++] = "tcp";
+        if (x_listen_fd >= 0) {
+          struct pollfd pfd = {.fd = x_listen_fd, .events = POLLIN};
+
+          // Don't outlive sommelier while waiting for a client.
+          prctl(PR_SET_PDEATHSIG, SIGTERM);
+          while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+            continue;
+
+          fd = dup(x_listen_fd);
+          snprintf(listen_fd_str, sizeof(listen_fd_str), "%d", fd);
+          args[i++] = "-listen";
+          args[i++] = listen_fd_str;
+        }
         args[i++] = "-rootless";
         if (xwl.drm_device) {
           // Use DRM and software rendering unless glamor is enabled.
@@ -7240,6 +10462,8 @@ int main(int argc, char **argv) {
         _exit(EXIT_FAILURE);
       }
       close(wm[1]);
+      if (x_listen_fd >= 0)
+        close(x_listen_fd);
       xwl.xwayland_pid = pid;
     } else {
       pid = fork();
@@ -7249,11 +10473,175 @@ int main(int argc, char **argv) {
         _exit(EXIT_FAILURE);
       }
       xwl.child_pid = pid;
+      xwl_startup_milestone(&xwl, STARTUP_CHILD_SPAWNED);
     }
     close(sv[1]);
   }
 
-  wl_client_add_destroy_listener(xwl.client, &client_destroy_listener);
+  xwl.xkb_context = xkb_context_new(0);
+  assert(xwl.xkb_context);
+  wl_list_init(&xwl.keymaps);
+
+  if (keymap_cache) {
+    if (keymap_cache[0] == '/') {
+      snprintf(keymap_cache_path, sizeof(keymap_cache_path), "%s",
+               keymap_cache);
+    } else {
+      snprintf(keymap_cache_path, sizeof(keymap_cache_path), "%s/%s",
+               runtime_dir, keymap_cache);
+    }
+    xwl.keymap_cache = keymap_cache_path;
+
+    // Pre-started workers compile the last keymap while they wait for a
+    // client. Others would only move the compile earlier.
+    if (xwl.worker_fd != -1)
+      xwl_keymap_cache_load(&xwl);
+  }
+
+  if (virtwl_display_fd != -1) {
+    xwl.display = wl_display_connect_to_fd(virtwl_display_fd);
+  } else {
+    if (display == NULL)
+      display = getenv("WAYLAND_DISPLAY");
+    if (display == NULL)
+      display = "wayland-0";
+
+    xwl.display = wl_display_connect(display);
+  }
+
+  if (!xwl.display) {
+    fprintf(stderr, "error: failed to connect to %s\n", display);
+    return EXIT_FAILURE;
+  }
+  xwl_startup_milestone(&xwl, STARTUP_HOST_CONNECTED);
+
+  wl_list_init(&xwl.accelerators);
+  wl_list_init(&xwl.registries);
+  wl_list_init(&xwl.globals);
+  wl_list_init(&xwl.outputs);
+  wl_list_init(&xwl.host_outputs);
+  wl_list_init(&xwl.seats);
+  wl_list_init(&xwl.windows);
+  wl_list_init(&xwl.unpaired_windows);
+  wl_list_init(&xwl.dirty_windows);
+  wl_list_init(&xwl.selection_transfers);
+  wl_list_init(&xwl.selection_queued_transfers);
+  wl_list_init(&xwl.virtwl_pools);
+  wl_list_init(&xwl.host_surfaces);
+
+  if (accelerators && xwl_parse_accelerators(&xwl.accelerators, accelerators))
+    return EXIT_FAILURE;
+
+  xwl.display_event_source =
+      wl_event_loop_add_fd(event_loop, wl_display_get_fd(xwl.display),
+                           WL_EVENT_READABLE, xwl_handle_event, &xwl);
+
+  xwl.selection_transfer_event_source = wl_event_loop_add_timer(
+      event_loop, xwl_handle_selection_transfer_timer, &xwl);
+
+  if (xwl.clipboard_manager && xwl.clipboard_prefetch_size) {
+    xwl.selection_prefetch_event_source = wl_event_loop_add_timer(
+        event_loop, xwl_handle_selection_prefetch_timer, &xwl);
+  }
+
+  if (xwl.stats_interval) {
+    xwl.stats_event_source =
+        wl_event_loop_add_timer(event_loop, xwl_handle_stats_timer, &xwl);
+    wl_event_source_timer_update(xwl.stats_event_source,
+                                 xwl.stats_interval * 1000);
+  }
+
+  if (xwl.buffer_idle_timeout) {
+    xwl.buffer_trim_event_source =
+        wl_event_loop_add_timer(event_loop, xwl_handle_buffer_trim_timer, &xwl);
+    wl_event_source_timer_update(xwl.buffer_trim_event_source,
+                                 xwl.buffer_idle_timeout);
+  }
+
+  if (control_socket) {
+    struct sockaddr_un addr = {.sun_family = AF_LOCAL};
+    struct stat control_stat;
+    int control_fd;
+
+    if (control_socket[0] == '/') {
+      snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", control_socket);
+    } else {
+      snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", runtime_dir,
+               control_socket);
+    }
+
+    control_fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (control_fd < 0) {
+      fprintf(stderr, "error: socket failed: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+    // Only remove a socket left behind by a previous instance, never a
+    // regular file or a socket that is still in use.
+    if (!lstat(addr.sun_path, &control_stat)) {
+      int probe_fd;
+
+      if (!S_ISSOCK(control_stat.st_mode)) {
+        fprintf(stderr, "error: %s exists and is not a socket\n",
+                addr.sun_path);
+        return EXIT_FAILURE;
+      }
+
+      probe_fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      assert(probe_fd >= 0);
+      rv = connect(probe_fd, (struct sockaddr *)&addr, sizeof(addr));
+      close(probe_fd);
+      if (!rv) {
+        fprintf(stderr, "error: %s is in use\n", addr.sun_path);
+        return EXIT_FAILURE;
+      }
+      unlink(addr.sun_path);
+    }
+
+    rv = bind(control_fd, (struct sockaddr *)&addr,
+              offsetof(struct sockaddr_un, sun_path) + strlen(addr.sun_path));
+    if (rv < 0 || listen(control_fd, CONTROL_SOCKET_BACKLOG) < 0) {
+      fprintf(stderr, "error: failed to listen on %s: %s\n", addr.sun_path,
+              strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+    xwl_unlink_at_exit(addr.sun_path);
+    wl_event_loop_add_fd(event_loop, control_fd, WL_EVENT_READABLE,
+                         xwl_handle_control_connection, &xwl);
+  }
+
+  // Exit normally on termination so that files registered for removal at
+  // exit are cleaned up. Set up after all programs have been started as the
+  // signals are blocked while handled by the event loop.
+  if (xwl_exit_unlink_count) {
+    wl_event_loop_add_signal(event_loop, SIGTERM, xwl_handle_exit_signal,
+                             NULL);
+    wl_event_loop_add_signal(event_loop, SIGINT, xwl_handle_exit_signal, NULL);
+  }
+
+  wl_registry_add_listener(wl_display_get_registry(xwl.display),
+                           &xwl_registry_listener, &xwl);
+
+  // Host globals have been announced by the time this sync completes.
+  wl_callback_add_listener(wl_display_sync(xwl.display),
+                           &xwl_registry_sync_listener, &xwl);
+
+  if (master_fd != -1) {
+    wl_event_loop_add_fd(event_loop, master_fd, WL_EVENT_READABLE,
+                         xwl_handle_master_connection, &xwl);
+  }
+
+  // Workers have connected to the host and processed its globals by the
+  // time the master hands them a client.
+  if (xwl.worker_fd != -1) {
+    xwl.worker_event_source =
+        wl_event_loop_add_fd(event_loop, xwl.worker_fd, WL_EVENT_READABLE,
+                             xwl_handle_worker_event, &xwl);
+  }
+
+  if (client_fd != -1)
+    xwl_create_client(&xwl, client_fd);
 
   do {
     wl_display_flush_clients(xwl.host_display);
@@ -7266,7 +10654,7 @@ int main(int argc, char **argv) {
     }
     if (wl_display_flush(xwl.display) < 0)
       return EXIT_FAILURE;
-  } while (wl_event_loop_dispatch(event_loop, -1) != -1);
+  } while (xwl_dispatch(&xwl, event_loop) != -1);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,102 @@
+#!/bin/bash
+#
+# Measures Wayland protocol throughput through the virtwl path of sommelier
+# for a range of --virtwl-buffer-size values.
+#
+# sommelier reaches the host compositor through the mock virtwl device in
+# virtwl-mock.so. The mock adds VIRTWL_MOCK_LATENCY_US to every ioctl, so
+# time spent per client run tracks the number of virtwl transactions.
+#
+# Requires a running host compositor ($WAYLAND_DISPLAY) and a client that
+# generates protocol traffic, wayland-info by default.
+#
+# Usage: ./virtwl-bench.sh [SIZE...]
+#
+# Environment:
+#   SOMMELIER               sommelier binary (default: ./sommelier)
+#   VIRTWL_MOCK             mock device library (default: ./virtwl-mock.so)
+#   VIRTWL_MOCK_LATENCY_US  latency added to each ioctl (default: 100)
+#   BENCH_CLIENT            client command (default: wayland-info)
+#   BENCH_RUNS              client runs per buffer size (default: 20)
+
+set -e
+
+SOMMELIER="${SOMMELIER:-./sommelier}"
+VIRTWL_MOCK="${VIRTWL_MOCK:-./virtwl-mock.so}"
+VIRTWL_MOCK_LATENCY_US="${VIRTWL_MOCK_LATENCY_US:-100}"
+BENCH_CLIENT="${BENCH_CLIENT:-wayland-info}"
+BENCH_RUNS="${BENCH_RUNS:-20}"
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# Runs the client BENCH_RUNS times against a sommelier instance that uses
+# |size| byte virtwl transactions and prints the elapsed time.
+run_size() {
+    local size="$1"
+    local socket="virtwl-bench-$$"
+    local log
+    local pid
+    local start
+    local end
+    local i
+
+    log="$(mktemp)"
+
+    VIRTWL_MOCK_DISPLAY="${WAYLAND_DISPLAY:-wayland-0}" \
+    VIRTWL_MOCK_LATENCY_US="${VIRTWL_MOCK_LATENCY_US}" \
+    LD_PRELOAD="$(realpath "${VIRTWL_MOCK}")" \
+        "${SOMMELIER}" --master --single-process --socket="${socket}" \
+        --virtwl-device=/dev/wl0 --virtwl-buffer-size="${size}" \
+        2> "${log}" &
+    pid=$!
+
+    for i in $(seq 50); do
+        [ -S "${XDG_RUNTIME_DIR}/${socket}" ] && break
+        sleep 0.1
+    done
+    if [ ! -S "${XDG_RUNTIME_DIR}/${socket}" ]; then
+        echo "sommelier failed to start:" >&2
+        cat "${log}" >&2
+        kill "${pid}" 2> /dev/null || true
+        rm -f "${log}"
+        exit 1
+    fi
+
+    start="$(now_ms)"
+    for i in $(seq "${BENCH_RUNS}"); do
+        WAYLAND_DISPLAY="${socket}" ${BENCH_CLIENT} > /dev/null
+    done
+    end="$(now_ms)"
+
+    kill "${pid}"
+    wait "${pid}" 2> /dev/null || true
+    rm -f "${log}"
+
+    printf "%12s %10s %10s\n" "${size}" "$(( end - start ))" \
+        "$(( (end - start) / BENCH_RUNS ))"
+}
+
+main() {
+    local sizes=("$@")
+    local size
+
+    if [ -z "${XDG_RUNTIME_DIR}" ]; then
+        echo "XDG_RUNTIME_DIR not set in the environment" >&2
+        exit 1
+    fi
+
+    if [ "${#sizes[@]}" -eq 0 ]; then
+        sizes=(4096 16384 65536 262144 1048576)
+    fi
+
+    echo "latency ${VIRTWL_MOCK_LATENCY_US}us, ${BENCH_RUNS} runs of" \
+        "${BENCH_CLIENT}"
+    printf "%12s %10s %10s\n" "buffer size" "total ms" "ms/run"
+    for size in "${sizes[@]}"; do
+        run_size "${size}"
+    done
+}
+
+main "$@"
@@ -0,0 +1,379 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// LD_PRELOAD shim that emulates the virtwl device on a plain Linux host.
+//
+// Opening the virtwl device path returns a mock device. Contexts are
+// connections to a local Wayland compositor, allocations are memfds and
+// pipes are regular pipes. The far end of a pipe is substituted when the
+// pipe is sent to the host, like the real device does.
+//
+// Environment:
+//   VIRTWL_MOCK_DEVICE      Device path to emulate (default: /dev/wl0).
+//   VIRTWL_MOCK_DISPLAY     Wayland socket to use for contexts (default:
+//                           $WAYLAND_DISPLAY or wayland-0).
+//   VIRTWL_MOCK_LATENCY_US  Delay added to each ioctl, in microseconds.
+//
+// Usage:
+//   LD_PRELOAD=./virtwl-mock.so sommelier --virtwl-device=/dev/wl0 ...
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "virtwl.h"
+
+#define MAX_PIPES 256
+
+struct mock_pipe {
+  ino_t ino;
+  int far_fd;
+};
+
+static int mock_device_fd = -1;
+static struct mock_pipe mock_pipes[MAX_PIPES];
+static int mock_pipe_count;
+
+static int (*real_open)(const char *pathname, int flags, ...);
+static int (*real_open64)(const char *pathname, int flags, ...);
+static int (*real_ioctl)(int fd, unsigned long request, ...);
+
+static void mock_init(void) {
+  if (!real_open)
+    real_open = dlsym(RTLD_NEXT, "open");
+  if (!real_open64)
+    real_open64 = dlsym(RTLD_NEXT, "open64");
+  if (!real_ioctl)
+    real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+}
+
+static const char *mock_device_path(void) {
+  const char *path = getenv("VIRTWL_MOCK_DEVICE");
+
+  return path ? path : "/dev/wl0";
+}
+
+static void mock_delay(void) {
+  const char *latency = getenv("VIRTWL_MOCK_LATENCY_US");
+
+  if (latency)
+    usleep(atoi(latency));
+}
+
+static int mock_connect_display(void) {
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  const char *display = getenv("VIRTWL_MOCK_DISPLAY");
+  struct sockaddr_un addr = {.sun_family = AF_LOCAL};
+  int fd;
+
+  if (!display)
+    display = getenv("WAYLAND_DISPLAY");
+  if (!display)
+    display = "wayland-0";
+
+  if (display[0] == '/') {
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", display);
+  } else {
+    if (!runtime_dir) {
+      errno = ENOENT;
+      return -1;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", runtime_dir,
+             display);
+  }
+
+  fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Drops pipes whose local end has been closed without being sent. The far
+// end then reports a hangup (read end) or an error (write end).
+static void mock_prune_pipes(void) {
+  int i = 0;
+
+  while (i < mock_pipe_count) {
+    struct pollfd pfd = {.fd = mock_pipes[i].far_fd, .events = 0};
+
+    if (poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLHUP | POLLERR))) {
+      close(mock_pipes[i].far_fd);
+      mock_pipes[i] = mock_pipes[--mock_pipe_count];
+    } else {
+      ++i;
+    }
+  }
+}
+
+static int mock_new_pipe(int read) {
+  struct stat st;
+  int p[2];
+
+  mock_prune_pipes();
+  if (mock_pipe_count == MAX_PIPES) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  if (pipe2(p, O_CLOEXEC) < 0)
+    return -1;
+
+  fstat(p[0], &st);
+  mock_pipes[mock_pipe_count].ino = st.st_ino;
+  mock_pipes[mock_pipe_count].far_fd = read ? p[1] : p[0];
+  ++mock_pipe_count;
+
+  return read ? p[0] : p[1];
+}
+
+// Returns the end of a mock pipe that belongs to the host, or -1 if |fd| is
+// not a mock pipe. The entry is removed as the host now owns that end.
+static int mock_take_far_fd(int fd) {
+  struct stat st;
+  int far_fd;
+  int i;
+
+  if (fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode))
+    return -1;
+
+  for (i = 0; i < mock_pipe_count; ++i) {
+    if (mock_pipes[i].ino == st.st_ino) {
+      far_fd = mock_pipes[i].far_fd;
+      mock_pipes[i] = mock_pipes[--mock_pipe_count];
+      return far_fd;
+    }
+  }
+
+  return -1;
+}
+
+static int mock_ioctl_new(struct virtwl_ioctl_new *new_ioctl) {
+  int fd;
+
+  switch (new_ioctl->type) {
+  case VIRTWL_IOCTL_NEW_CTX:
+    fd = mock_connect_display();
+    break;
+  case VIRTWL_IOCTL_NEW_ALLOC:
+    fd = memfd_create("virtwl-mock", MFD_CLOEXEC);
+    if (fd >= 0 && ftruncate(fd, new_ioctl->size) < 0) {
+      close(fd);
+      fd = -1;
+    }
+    break;
+  case VIRTWL_IOCTL_NEW_PIPE_READ:
+    fd = mock_new_pipe(1);
+    break;
+  case VIRTWL_IOCTL_NEW_PIPE_WRITE:
+    fd = mock_new_pipe(0);
+    break;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (fd < 0)
+    return -1;
+
+  new_ioctl->fd = fd;
+  return 0;
+}
+
+static int mock_ioctl_send(int fd, struct virtwl_ioctl_txn *txn) {
+  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
+  int far_fds[VIRTWL_SEND_MAX_ALLOCS];
+  int fds[VIRTWL_SEND_MAX_ALLOCS];
+  struct iovec iov = {.iov_base = txn->data, .iov_len = txn->len};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  ssize_t bytes;
+  int fd_count;
+  int i;
+
+  for (fd_count = 0; fd_count < VIRTWL_SEND_MAX_ALLOCS; ++fd_count) {
+    if (txn->fds[fd_count] < 0)
+      break;
+    far_fds[fd_count] = mock_take_far_fd(txn->fds[fd_count]);
+    fds[fd_count] =
+        far_fds[fd_count] >= 0 ? far_fds[fd_count] : txn->fds[fd_count];
+  }
+
+  if (fd_count) {
+    struct cmsghdr *cmsg;
+
+    msg.msg_control = fd_buffer;
+    msg.msg_controllen = CMSG_LEN(fd_count * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+  }
+
+  bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+  for (i = 0; i < fd_count; ++i) {
+    if (far_fds[i] >= 0)
+      close(far_fds[i]);
+  }
+
+  if (bytes < 0)
+    return -1;
+  if (bytes != txn->len) {
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int mock_ioctl_recv(int fd, struct virtwl_ioctl_txn *txn) {
+  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
+  struct iovec iov = {.iov_base = txn->data, .iov_len = txn->len};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = fd_buffer,
+                       .msg_controllen = sizeof(fd_buffer)};
+  struct cmsghdr *cmsg;
+  ssize_t bytes;
+  int fd_count = 0;
+  int i;
+
+  bytes = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  if (bytes < 0)
+    return -1;
+  if (bytes == 0) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  for (cmsg = msg.msg_controllen ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    size_t cmsg_fd_count;
+
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+
+    cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(&txn->fds[fd_count], CMSG_DATA(cmsg), cmsg_fd_count * sizeof(int));
+    fd_count += cmsg_fd_count;
+  }
+
+  for (i = fd_count; i < VIRTWL_SEND_MAX_ALLOCS; ++i)
+    txn->fds[i] = -1;
+
+  txn->len = bytes;
+  return 0;
+}
+
+// Returns a new descriptor for the mock device, or -1 with errno set to
+// ENODEV if |pathname| is not the emulated device.
+static int mock_open_device(const char *pathname) {
+  if (strcmp(pathname, mock_device_path()) != 0) {
+    errno = ENODEV;
+    return -1;
+  }
+
+  // A memfd gives the device an identity that no other file shares.
+  if (mock_device_fd < 0)
+    mock_device_fd = memfd_create("virtwl-mock-device", MFD_CLOEXEC);
+  if (mock_device_fd < 0)
+    return -1;
+
+  return fcntl(mock_device_fd, F_DUPFD_CLOEXEC, 0);
+}
+
+static int mock_is_device(int fd) {
+  struct stat device_st, st;
+
+  if (mock_device_fd < 0)
+    return 0;
+
+  return fstat(mock_device_fd, &device_st) == 0 && fstat(fd, &st) == 0 &&
+         st.st_dev == device_st.st_dev && st.st_ino == device_st.st_ino;
+}
+
+int open(const char *pathname, int flags, ...) {
+  mode_t mode = 0;
+  va_list ap;
+  int fd;
+
+  mock_init();
+
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    va_start(ap, flags);
+    mode = va_arg(ap, int);
+    va_end(ap);
+  }
+
+  fd = mock_open_device(pathname);
+  if (fd >= 0 || errno != ENODEV)
+    return fd;
+
+  return real_open(pathname, flags, mode);
+}
+
+int open64(const char *pathname, int flags, ...) {
+  mode_t mode = 0;
+  va_list ap;
+  int fd;
+
+  mock_init();
+
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    va_start(ap, flags);
+    mode = va_arg(ap, int);
+    va_end(ap);
+  }
+
+  fd = mock_open_device(pathname);
+  if (fd >= 0 || errno != ENODEV)
+    return fd;
+
+  return real_open64(pathname, flags, mode);
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+  void *arg;
+  va_list ap;
+
+  mock_init();
+
+  va_start(ap, request);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+
+  switch (request) {
+  case VIRTWL_IOCTL_NEW:
+    // Only the device itself creates new objects.
+    if (!mock_is_device(fd))
+      break;
+    mock_delay();
+    return mock_ioctl_new(arg);
+  case VIRTWL_IOCTL_SEND:
+    mock_delay();
+    return mock_ioctl_send(fd, arg);
+  case VIRTWL_IOCTL_RECV:
+    mock_delay();
+    return mock_ioctl_recv(fd, arg);
+  }
+
+  return real_ioctl(fd, request, arg);
+}